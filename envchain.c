@@ -33,6 +33,11 @@
 #include <termios.h>
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #include <readline/readline.h>
 
@@ -62,8 +67,16 @@ envchain_abort_with_help(void)
     "    %s NAMESPACE CMD [ARG ...]\n"
     "  List namespaces\n"
     "    %s --list\n"
+    "    %s --rebuild-registry\n"
     "  Remove variables\n"
     "    %s --unset NAMESPACE ENV [ENV ..]\n"
+    "  Execute with variables loaded on first getenv (Linux)\n"
+    "    %s --lazy NAMESPACE CMD [ARG ...]\n"
+    "  Render template\n"
+    "    %s --render TEMPLATE [-o OUT|--memfd] NAMESPACE[,NAMESPACE ..] [CMD [ARG ...]]\n"
+    "  Back up or restore all variables\n"
+    "    %s --backup FILE\n"
+    "    %s --restore FILE\n"
     "\n"
     "Options:\n"
     "  --keychain:\n"
@@ -89,8 +102,27 @@ envchain_abort_with_help(void)
     "  --require-passphrase (-p), --no-require-passphrase (-P):\n"
     "    Replace the item's ACL list to require passphrase (or not).\n"
     "    Leave as is when both options are omitted.\n"
+    "\n"
+    "  --rebuild-registry:\n"
+    "    Regenerate the namespace registry that --list reads, from a full scan.\n"
+    "\n"
+    "  --lazy:\n"
+    "    Export placeholders and preload libenvchain-lazy.so, which fetches a value\n"
+    "    when CMD first calls getenv(3) for it, by running this envchain binary.\n"
+    "    Override the shim path with ENVCHAIN_LAZY_SHIM.\n"
+    "\n"
+    "  --render:\n"
+    "    Replace {{NAMESPACE.ENV}} in TEMPLATE (- for stdin) and write to stdout,\n"
+    "    atomically to OUT with mode 0600 (-o), or to a sealed memfd (--memfd, Linux).\n"
+    "    CMD is executed with the rendered path in ENVCHAIN_RENDERED_FILE and\n"
+    "    in place of {} arguments.\n"
+    "\n"
+    "  --backup, --restore:\n"
+    "    Write every namespace into a passphrase-encrypted archive (via openssl),\n"
+    "    or store all items of such an archive.\n"
     ,
-    envchain_name, version, envchain_name, envchain_name, envchain_name, envchain_name, envchain_name, envchain_name
+    envchain_name, version, envchain_name, envchain_name, envchain_name, envchain_name, envchain_name, envchain_name, envchain_name,
+    envchain_name, envchain_name, envchain_name, envchain_name
   );
   exit(2);
 }
@@ -164,6 +196,7 @@ envchain_set(int argc, const char **argv)
   int require_passphrase = -1;
   const char *name, *key;
   char *value;
+  int result = 0;
 
   while (2 < argc) {
     if (argv[0][0] != '-') break;
@@ -197,10 +230,12 @@ envchain_set(int argc, const char **argv)
     value = envchain_ask_value(name, key, noecho);
     if (value == NULL) return 1;
 
-    envchain_save_value(name, key, value, require_passphrase);
+    if (envchain_save_value(name, key, value, require_passphrase) != 0) {
+      result = 1;
+    }
   }
 
-  return 0;
+  return result;
 }
 
 /* functions for list */
@@ -362,6 +397,1110 @@ envchain_exec(int argc, const char **argv)
   return 0;
 }
 
+/* functions for --lazy */
+
+#define ENVCHAIN_LAZY_SHIM_NAME "libenvchain-lazy.so"
+/* used when there is no shim next to the binary (BINDIR/../lib) */
+#ifndef ENVCHAIN_LAZY_SHIM_PATH
+#define ENVCHAIN_LAZY_SHIM_PATH "/usr/lib/" ENVCHAIN_LAZY_SHIM_NAME
+#endif
+
+static void
+envchain_lazy_key_callback(const char *key, void *context)
+{
+  char *placeholder = NULL;
+
+  asprintf(&placeholder, "%s%s", ENVCHAIN_LAZY_PLACEHOLDER, (const char*)context);
+  if (placeholder == NULL) {
+    fprintf(stderr, "Failed to generate placeholder\n");
+    exit(10);
+  }
+  setenv(key, placeholder, 1);
+  free(placeholder);
+}
+
+int
+envchain_lazy(int argc, const char **argv)
+{
+  if (argc < 2) envchain_abort_with_help();
+
+  char *name, *names, *shim, *helper, *slash, *sibling = NULL, *preload = NULL;
+  const char *current;
+
+  names = (char*)argv[0];
+  argv++; argc--;
+
+  /* only key names are fetched here; values are loaded by the shim */
+  while ((name = strsep(&names, ",")) != NULL) {
+    if (envchain_search_keys(name, &envchain_lazy_key_callback, name) != 0) return 1;
+  }
+
+  /* the shim fetches each value through a fresh envchain process, so no
+   * secret service connection lives inside CMD */
+  helper = realpath("/proc/self/exe", NULL);
+  if (helper == NULL) {
+    fprintf(stderr, "%s: cannot resolve own path: %s\n", envchain_name, strerror(errno));
+    return 1;
+  }
+  setenv(ENVCHAIN_LAZY_HELPER_ENV, helper, 1);
+
+  /* prefer the shim installed alongside this binary, wherever that is */
+  shim = getenv("ENVCHAIN_LAZY_SHIM");
+  if (shim == NULL || shim[0] == '\0') {
+    slash = strrchr(helper, '/');
+    if (slash != NULL) {
+      *slash = '\0';
+      asprintf(&sibling, "%s/../lib/%s", helper, ENVCHAIN_LAZY_SHIM_NAME);
+    }
+    shim = sibling != NULL && access(sibling, R_OK) == 0 ? sibling : ENVCHAIN_LAZY_SHIM_PATH;
+  }
+  free(helper);
+  if (access(shim, R_OK) != 0) {
+    fprintf(stderr, "%s: cannot load `%s`: %s\n", envchain_name, shim, strerror(errno));
+    return 1;
+  }
+
+  current = getenv("LD_PRELOAD");
+  if (current != NULL && current[0] != '\0') {
+    asprintf(&preload, "%s:%s", shim, current);
+  }
+  else {
+    preload = strdup(shim);
+  }
+  if (preload == NULL) {
+    fprintf(stderr, "Failed to generate LD_PRELOAD\n");
+    exit(10);
+  }
+  setenv("LD_PRELOAD", preload, 1);
+  free(preload);
+  free(sibling);
+
+  char **args = malloc(sizeof(char*) * (argc + 1));
+  memcpy(args, argv, sizeof(char*) * argc);
+  args[argc] = NULL;
+
+  if (execvp(args[0], args) < 0) {
+    fprintf(stderr, "execvp failed: %s\n", strerror(errno));
+    return 1;
+  }
+  return 0;
+}
+
+static void
+envchain_lazy_fetch_callback(const char *key, const char *value, void *context)
+{
+  (void)key; /* silence warning */
+
+  if (*(int*)context == 0) fputs(value, stdout);
+  *(int*)context = 1;
+}
+
+/* internal: run by libenvchain-lazy.so; prints a single value */
+int
+envchain_lazy_fetch(int argc, const char **argv)
+{
+  int found = 0;
+
+  if (argc != 2) envchain_abort_with_help();
+
+  if (envchain_search_selected_values(argv[0], &argv[1], 1,
+                                      &envchain_lazy_fetch_callback, &found) != 0)
+    return 1;
+  if (fflush(stdout) != 0) return 1;
+  return found ? 0 : ENVCHAIN_LAZY_NOT_FOUND;
+}
+
+/* functions for --render */
+
+static char*
+envchain_read_stream(FILE *fp, const char *path, size_t *out_len)
+{
+  char *buf = NULL;
+  size_t len = 0, cap = 0, n;
+
+  do {
+    if (cap - len < 4096) {
+      cap = cap ? cap * 2 : 8192;
+      buf = realloc(buf, cap);
+      if (buf == NULL) {
+        fprintf(stderr, "malloc fail (read)\n");
+        exit(10);
+      }
+    }
+    n = fread(buf + len, 1, cap - len - 1, fp);
+    len += n;
+  } while (n > 0);
+
+  if (ferror(fp)) {
+    fprintf(stderr, "%s: cannot read `%s`: %s\n", envchain_name, path, strerror(errno));
+    free(buf);
+    buf = NULL;
+  }
+  else {
+    buf[len] = '\0';
+    *out_len = len;
+  }
+
+  return buf;
+}
+
+static char*
+envchain_read_file(const char *path, size_t *out_len)
+{
+  FILE *fp;
+  char *buf;
+
+  fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+  if (fp == NULL) {
+    fprintf(stderr, "%s: cannot open `%s`: %s\n", envchain_name, path, strerror(errno));
+    return NULL;
+  }
+
+  buf = envchain_read_stream(fp, path, out_len);
+
+  if (fp != stdin) fclose(fp);
+  return buf;
+}
+
+/* Parses `{{NS.KEY}}` starting at p (pointing at the opening braces).
+ * Returns the length of the whole reference or 0 when p is not a reference. */
+static size_t
+envchain_render_parse_ref(const char *p, const char *end,
+                          const char **name, size_t *name_len,
+                          const char **key, size_t *key_len)
+{
+  const char *s, *e, *close, *dot = NULL;
+
+  if (end - p < 4 || p[0] != '{' || p[1] != '{') return 0;
+
+  for (close = p + 2; close + 1 < end; close++) {
+    if (close[0] == '}' && close[1] == '}') break;
+    if (*close == '\n' || *close == '{') return 0;
+  }
+  if (close + 1 >= end) return 0;
+
+  s = p + 2;
+  e = close;
+  while (s < e && (*s == ' ' || *s == '\t')) s++;
+  while (s < e && (e[-1] == ' ' || e[-1] == '\t')) e--;
+
+  /* namespaces may contain dots; keys are environment variable names */
+  for (const char *q = s; q < e; q++) {
+    if (*q == '.') dot = q;
+  }
+  if (dot == NULL || dot == s || dot + 1 == e) return 0;
+
+  *name = s;
+  *name_len = dot - s;
+  *key = dot + 1;
+  *key_len = e - (dot + 1);
+  return (close + 2) - p;
+}
+
+static envchain_render_ref*
+envchain_render_find_ref(envchain_render_ref *refs,
+                         const char *name, size_t name_len,
+                         const char *key, size_t key_len)
+{
+  for (; refs != NULL; refs = refs->next) {
+    if (strlen(refs->name) == name_len && strncmp(refs->name, name, name_len) == 0 &&
+        strlen(refs->key) == key_len && strncmp(refs->key, key, key_len) == 0)
+      return refs;
+  }
+  return NULL;
+}
+
+static void
+envchain_render_value_callback(const char *key, const char *value, void *raw_context)
+{
+  envchain_render_context *context = (envchain_render_context*)raw_context;
+  envchain_render_ref *ref = envchain_render_find_ref(
+    context->refs, context->name, strlen(context->name), key, strlen(key));
+
+  if (ref == NULL || ref->value != NULL) return;
+  ref->value = strdup(value);
+  if (ref->value == NULL) {
+    fprintf(stderr, "malloc fail (value)\n");
+    exit(10);
+  }
+}
+
+static void
+envchain_render_free_refs(envchain_render_ref *refs)
+{
+  envchain_render_ref *next;
+
+  for (; refs != NULL; refs = next) {
+    next = refs->next;
+    if (refs->value) {
+      memset(refs->value, 0, strlen(refs->value));
+      free(refs->value);
+    }
+    free(refs->name);
+    free(refs->key);
+    free(refs);
+  }
+}
+
+static int
+envchain_render_namespace_requested(const char *names, const char *name, size_t name_len)
+{
+  const char *p = names, *comma;
+  size_t len;
+
+  while (p != NULL) {
+    comma = strchr(p, ',');
+    len = comma ? (size_t)(comma - p) : strlen(p);
+    if (len == name_len && strncmp(p, name, len) == 0) return 1;
+    p = comma ? comma + 1 : NULL;
+  }
+  return 0;
+}
+
+/* Collects references from the template, then loads the referenced keys
+ * with one backend query per namespace. */
+static int
+envchain_render_fetch(const char *tpl, size_t len, const char *names,
+                      envchain_render_ref **out_refs)
+{
+  const char *p = tpl, *end = tpl + len;
+  const char *name, *key;
+  size_t name_len, key_len, ref_len;
+  envchain_render_ref *refs = NULL, *ref, *iter;
+  envchain_render_context context;
+  const char **keys;
+  int key_count, result = 0;
+
+  while ((p = memchr(p, '{', end - p)) != NULL) {
+    ref_len = envchain_render_parse_ref(p, end, &name, &name_len, &key, &key_len);
+    if (ref_len == 0) {
+      p++;
+      continue;
+    }
+    p += ref_len;
+
+    if (!envchain_render_namespace_requested(names, name, name_len)) {
+      fprintf(stderr, "%s: template refers to namespace `%.*s` which is not requested\n",
+              envchain_name, (int)name_len, name);
+      result = 1;
+      continue;
+    }
+    if (envchain_render_find_ref(refs, name, name_len, key, key_len)) continue;
+
+    ref = calloc(1, sizeof(envchain_render_ref));
+    if (ref == NULL) {
+      fprintf(stderr, "malloc fail (ref)\n");
+      exit(10);
+    }
+    ref->name = strndup(name, name_len);
+    ref->key = strndup(key, key_len);
+    ref->next = refs;
+    refs = ref;
+  }
+
+  *out_refs = refs;
+  if (result != 0) return result;
+
+  for (ref = refs; ref != NULL; ref = ref->next) {
+    /* fetch each namespace only once, at its first reference */
+    for (iter = refs; iter != ref; iter = iter->next) {
+      if (strcmp(iter->name, ref->name) == 0) break;
+    }
+    if (iter != ref) continue;
+
+    /* only the referenced keys are loaded */
+    key_count = 0;
+    for (iter = ref; iter != NULL; iter = iter->next) {
+      if (strcmp(iter->name, ref->name) == 0) key_count++;
+    }
+    keys = malloc(sizeof(char*) * key_count);
+    if (keys == NULL) {
+      fprintf(stderr, "malloc fail (keys)\n");
+      exit(10);
+    }
+    key_count = 0;
+    for (iter = ref; iter != NULL; iter = iter->next) {
+      if (strcmp(iter->name, ref->name) == 0) keys[key_count++] = iter->key;
+    }
+
+    context.name = ref->name;
+    context.refs = refs;
+    if (envchain_search_selected_values(ref->name, keys, key_count,
+                                        &envchain_render_value_callback, &context) != 0)
+      result = 1;
+    free(keys);
+  }
+
+  for (ref = refs; ref != NULL; ref = ref->next) {
+    if (ref->value == NULL) {
+      fprintf(stderr, "%s: `%s.%s` not found\n", envchain_name, ref->name, ref->key);
+      result = 1;
+    }
+  }
+
+  return result;
+}
+
+static int
+envchain_write_all(int fd, const char *buf, size_t len)
+{
+  ssize_t n;
+
+  while (0 < len) {
+    n = write(fd, buf, len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int
+envchain_render_write(int fd, const char *tpl, size_t len, envchain_render_ref *refs)
+{
+  const char *p = tpl, *end = tpl + len, *brace;
+  const char *name, *key;
+  size_t name_len, key_len, ref_len;
+  envchain_render_ref *ref;
+
+  while (p < end) {
+    brace = memchr(p, '{', end - p);
+    if (brace == NULL) brace = end;
+    if (envchain_write_all(fd, p, brace - p) < 0) return -1;
+    p = brace;
+    if (p == end) break;
+
+    ref_len = envchain_render_parse_ref(p, end, &name, &name_len, &key, &key_len);
+    ref = ref_len ? envchain_render_find_ref(refs, name, name_len, key, key_len) : NULL;
+    if (ref == NULL) {
+      if (envchain_write_all(fd, p, 1) < 0) return -1;
+      p++;
+      continue;
+    }
+    if (envchain_write_all(fd, ref->value, strlen(ref->value)) < 0) return -1;
+    p += ref_len;
+  }
+  return 0;
+}
+
+static int
+envchain_render_to_file(const char *out, const char *tpl, size_t len, envchain_render_ref *refs)
+{
+  char *tmp = NULL;
+  int fd;
+
+  asprintf(&tmp, "%s.XXXXXX", out);
+  if (tmp == NULL) {
+    fprintf(stderr, "Failed to generate temporary path\n");
+    exit(10);
+  }
+
+  /* mkstemp creates the file with 0600 */
+  fd = mkstemp(tmp);
+  if (fd < 0) {
+    fprintf(stderr, "%s: cannot create `%s`: %s\n", envchain_name, tmp, strerror(errno));
+    free(tmp);
+    return 1;
+  }
+
+  if (envchain_render_write(fd, tpl, len, refs) < 0 || fsync(fd) < 0) {
+    fprintf(stderr, "%s: cannot write `%s`: %s\n", envchain_name, tmp, strerror(errno));
+    goto fail;
+  }
+  if (close(fd) < 0) {
+    fd = -1;
+    fprintf(stderr, "%s: cannot write `%s`: %s\n", envchain_name, tmp, strerror(errno));
+    goto fail;
+  }
+  fd = -1;
+
+  if (rename(tmp, out) < 0) {
+    fprintf(stderr, "%s: cannot rename to `%s`: %s\n", envchain_name, out, strerror(errno));
+    goto fail;
+  }
+
+  free(tmp);
+  return 0;
+
+fail:
+  if (fd >= 0) close(fd);
+  unlink(tmp);
+  free(tmp);
+  return 1;
+}
+
+static int
+envchain_render_to_memfd(const char *tpl, size_t len, envchain_render_ref *refs)
+{
+#ifdef MFD_ALLOW_SEALING
+  int fd = memfd_create("envchain-render", MFD_ALLOW_SEALING);
+  if (fd < 0) {
+    fprintf(stderr, "%s: memfd_create failed: %s\n", envchain_name, strerror(errno));
+    return -1;
+  }
+
+  if (envchain_render_write(fd, tpl, len, refs) < 0 ||
+      fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0 ||
+      lseek(fd, 0, SEEK_SET) < 0) {
+    fprintf(stderr, "%s: cannot write memfd: %s\n", envchain_name, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+#else
+  (void)tpl; (void)len; (void)refs; /* silence warning */
+  fprintf(stderr, "%s: `--memfd' is unsupported on this platform\n", envchain_name);
+  return -1;
+#endif
+}
+
+int
+envchain_render(int argc, const char **argv)
+{
+  const char *template_path, *out = NULL;
+  char *names, *tpl, *path = NULL;
+  size_t len;
+  int use_memfd = 0, fd, rc;
+  envchain_render_ref *refs = NULL;
+
+  if (argc < 2) envchain_abort_with_help();
+
+  template_path = argv[0];
+  argv++; argc--;
+
+  while (0 < argc && argv[0][0] == '-') {
+    if (strcmp(argv[0], "-o") == 0 || strcmp(argv[0], "--output") == 0) {
+      argv++; argc--;
+      if (argc < 1) {
+        fprintf(stderr, "Missing argument for -o\n");
+        return 2;
+      }
+      out = argv[0];
+      argv++; argc--;
+    }
+    else if (strcmp(argv[0], "--memfd") == 0) {
+      argv++; argc--;
+      use_memfd = 1;
+    }
+    else {
+      fprintf(stderr, "Unknown option: %s\n", argv[0]);
+      return 1;
+    }
+  }
+  if (argc < 1) envchain_abort_with_help();
+  if (out != NULL && use_memfd) {
+    fprintf(stderr, "-o and --memfd are mutually exclusive\n");
+    return 2;
+  }
+  if (use_memfd && argc < 2) {
+    fprintf(stderr, "--memfd requires a command to execute\n");
+    return 2;
+  }
+  if (out == NULL && !use_memfd && 1 < argc) {
+    fprintf(stderr, "Executing a command requires either -o or --memfd\n");
+    return 2;
+  }
+
+  names = (char*)argv[0];
+  argv++; argc--;
+
+  tpl = envchain_read_file(template_path, &len);
+  if (tpl == NULL) return 1;
+
+  rc = envchain_render_fetch(tpl, len, names, &refs);
+  if (rc != 0) goto cleanup;
+
+  if (use_memfd) {
+    fd = envchain_render_to_memfd(tpl, len, refs);
+    if (fd < 0) {
+      rc = 1;
+      goto cleanup;
+    }
+    asprintf(&path, "/proc/self/fd/%d", fd);
+  }
+  else if (out != NULL) {
+    rc = envchain_render_to_file(out, tpl, len, refs);
+    if (rc != 0) goto cleanup;
+    path = strdup(out);
+  }
+  else {
+    if (envchain_render_write(STDOUT_FILENO, tpl, len, refs) < 0) {
+      fprintf(stderr, "%s: cannot write output: %s\n", envchain_name, strerror(errno));
+      rc = 1;
+    }
+    goto cleanup;
+  }
+
+  if (argc < 1) goto cleanup;
+  if (path == NULL) {
+    fprintf(stderr, "Failed to generate rendered path\n");
+    exit(10);
+  }
+
+  envchain_render_free_refs(refs);
+  refs = NULL;
+  free(tpl);
+  tpl = NULL;
+
+  /* `{}` arguments are replaced with the rendered file path */
+  for (int i = 0; i < argc; i++) {
+    if (strcmp(argv[i], "{}") == 0) argv[i] = path;
+  }
+  setenv("ENVCHAIN_RENDERED_FILE", path, 1);
+
+  char **args = malloc(sizeof(char*) * (argc + 1));
+  memcpy(args, argv, sizeof(char*) * argc);
+  args[argc] = NULL;
+
+  if (execvp(args[0], args) < 0) {
+    fprintf(stderr, "execvp failed: %s\n", strerror(errno));
+    rc = 1;
+  }
+  free(args);
+
+cleanup:
+  envchain_render_free_refs(refs);
+  if (tpl != NULL) free(tpl);
+  if (path != NULL) free(path);
+  return rc;
+}
+
+/* functions for --backup and --restore */
+
+/* Archive file: FILE_MAGIC | HMAC | salt | openssl ciphertext. The HMAC
+ * covers salt and ciphertext, keyed by PBKDF2 of the passphrase with that
+ * salt, since `openssl enc` itself does not authenticate. */
+#define ENVCHAIN_ARCHIVE_FILE_MAGIC "envchain-backup\n"
+#define ENVCHAIN_ARCHIVE_MAGIC_SIZE 16
+#define ENVCHAIN_ARCHIVE_SALT_SIZE 16
+#define ENVCHAIN_ARCHIVE_HEADER_SIZE \
+  (ENVCHAIN_ARCHIVE_MAGIC_SIZE + ENVCHAIN_HMAC_SIZE + ENVCHAIN_ARCHIVE_SALT_SIZE)
+#define ENVCHAIN_ARCHIVE_ITER 200000
+
+/* Records: NAME \t KEY \t REQUIRE_PASSPHRASE(-1|0|1) \t LENGTH \n VALUE \n */
+#define ENVCHAIN_ARCHIVE_MAGIC "envchain-backup 1\n"
+
+typedef struct {
+  char *name;
+  char *key;
+  char *value;
+  int require_passphrase;
+} envchain_archive_record;
+
+static char*
+envchain_ask_archive_passphrase(int confirm)
+{
+  char *passphrase, *again;
+
+  if (!isatty(STDIN_FILENO)) {
+    fprintf(stderr, "%s: the archive passphrase must be typed on a terminal\n", envchain_name);
+    return NULL;
+  }
+
+  passphrase = envchain_noecho_read("Archive passphrase");
+  if (passphrase == NULL) return NULL;
+  if (passphrase[0] == '\0') {
+    fprintf(stderr, "%s: passphrase must not be empty\n", envchain_name);
+    free(passphrase);
+    return NULL;
+  }
+  if (!confirm) return passphrase;
+
+  again = envchain_noecho_read("Confirm passphrase");
+  if (again == NULL || strcmp(passphrase, again) != 0) {
+    fprintf(stderr, "%s: passphrases do not match\n", envchain_name);
+    memset(passphrase, 0, strlen(passphrase));
+    free(passphrase);
+    passphrase = NULL;
+  }
+  if (again != NULL) {
+    memset(again, 0, strlen(again));
+    free(again);
+  }
+  return passphrase;
+}
+
+/* Spawns openssl(1) to encrypt (or decrypt) in_fd into out_fd. The passphrase
+ * is handed over through a pipe so it never appears in argv or environ. */
+static pid_t
+envchain_archive_spawn(int decrypt, const char *passphrase, int in_fd, int out_fd)
+{
+  int pass[2];
+  char *pass_arg = NULL;
+  pid_t pid;
+
+  if (pipe(pass) < 0) return -1;
+  fcntl(pass[1], F_SETFD, FD_CLOEXEC);
+  asprintf(&pass_arg, "fd:%d", pass[0]);
+  if (pass_arg == NULL) {
+    fprintf(stderr, "Failed to generate openssl arguments\n");
+    exit(10);
+  }
+
+  pid = fork();
+  if (pid == 0) {
+    const char *args[] = {
+      "openssl", "enc", decrypt ? "-d" : "-e", "-aes-256-cbc", "-md", "sha256",
+      "-pbkdf2", "-iter", "200000", "-salt", "-pass", pass_arg, NULL
+    };
+    if (dup2(in_fd, STDIN_FILENO) < 0 || dup2(out_fd, STDOUT_FILENO) < 0) _exit(127);
+    execvp(args[0], (char**)args);
+    fprintf(stderr, "%s: cannot execute openssl: %s\n", envchain_name, strerror(errno));
+    _exit(127);
+  }
+
+  free(pass_arg);
+  close(pass[0]);
+  if (pid < 0) {
+    close(pass[1]);
+    return -1;
+  }
+
+  if (envchain_write_all(pass[1], passphrase, strlen(passphrase)) < 0 ||
+      envchain_write_all(pass[1], "\n", 1) < 0) {
+    fprintf(stderr, "%s: cannot pass passphrase to openssl: %s\n", envchain_name, strerror(errno));
+  }
+  close(pass[1]);
+  return pid;
+}
+
+static int
+envchain_archive_random(unsigned char *buf, size_t len)
+{
+  ssize_t n;
+  int fd = open("/dev/urandom", O_RDONLY);
+
+  if (fd < 0) return 1;
+  while (0 < len) {
+    n = read(fd, buf, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    buf += n;
+    len -= n;
+  }
+  close(fd);
+  return len == 0 ? 0 : 1;
+}
+
+/* salt_ct is the salt followed by the ciphertext */
+static void
+envchain_archive_mac(const char *passphrase, const unsigned char *salt_ct, size_t len,
+                     unsigned char *mac)
+{
+  unsigned char key[ENVCHAIN_HMAC_SIZE];
+
+  envchain_pbkdf2_sha256(passphrase, salt_ct, ENVCHAIN_ARCHIVE_SALT_SIZE,
+                         ENVCHAIN_ARCHIVE_ITER, key);
+  envchain_hmac_sha256(key, sizeof(key), salt_ct, len, mac);
+  memset(key, 0, sizeof(key));
+}
+
+/* Fills in the HMAC of an archive file whose ciphertext has been written. */
+static int
+envchain_archive_seal(int fd, const char *passphrase)
+{
+  struct stat st;
+  unsigned char *buf, mac[ENVCHAIN_HMAC_SIZE];
+  size_t size, off = 0;
+  ssize_t n;
+
+  if (fstat(fd, &st) < 0 || st.st_size < ENVCHAIN_ARCHIVE_HEADER_SIZE) return 1;
+  size = st.st_size;
+  buf = malloc(size);
+  if (buf == NULL) {
+    fprintf(stderr, "malloc fail (archive)\n");
+    exit(10);
+  }
+  while (off < size) {
+    n = pread(fd, buf + off, size - off, off);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      free(buf);
+      return 1;
+    }
+    off += n;
+  }
+
+  envchain_archive_mac(passphrase, buf + ENVCHAIN_ARCHIVE_MAGIC_SIZE + ENVCHAIN_HMAC_SIZE,
+                       size - ENVCHAIN_ARCHIVE_MAGIC_SIZE - ENVCHAIN_HMAC_SIZE, mac);
+  free(buf);
+
+  if (pwrite(fd, mac, sizeof(mac), ENVCHAIN_ARCHIVE_MAGIC_SIZE) != (ssize_t)sizeof(mac)) return 1;
+  return 0;
+}
+
+static int
+envchain_archive_wait(pid_t pid)
+{
+  int status;
+
+  while (waitpid(pid, &status, 0) < 0) {
+    if (errno != EINTR) return 1;
+  }
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : 1;
+}
+
+static void
+envchain_backup_item_callback(const char *name, const char *key, const char *value,
+                              int require_passphrase, void *raw_context)
+{
+  envchain_backup_context *context = (envchain_backup_context*)raw_context;
+
+  if (value == NULL) {
+    fprintf(stderr, "%s: skipping unreadable item `%s.%s`\n",
+            envchain_name, name ? name : "?", key ? key : "?");
+    context->failures++;
+    return;
+  }
+  if (name == NULL || key == NULL || strpbrk(name, "\t\n") || strpbrk(key, "\t\n")) {
+    fprintf(stderr, "%s: skipping item with unsupported name `%s.%s`\n",
+            envchain_name, name ? name : "", key ? key : "");
+    context->failures++;
+    return;
+  }
+
+  fprintf(context->out, "%s\t%s\t%d\t%zu\n", name, key, require_passphrase, strlen(value));
+  fputs(value, context->out);
+  fputc('\n', context->out);
+  context->count++;
+
+  if (isatty(STDERR_FILENO) && context->count % 64 == 0)
+    fprintf(stderr, "\r%s: %d items", envchain_name, context->count);
+}
+
+int
+envchain_backup(int argc, const char **argv)
+{
+  const char *path;
+  char *passphrase, *tmp = NULL;
+  unsigned char header[ENVCHAIN_ARCHIVE_HEADER_SIZE];
+  int data[2], fd, rc = 0;
+  pid_t pid;
+  envchain_backup_context context = {NULL, 0, 0};
+
+  if (argc != 1) envchain_abort_with_help();
+  path = argv[0];
+
+  passphrase = envchain_ask_archive_passphrase(1);
+  if (passphrase == NULL) return 1;
+
+  asprintf(&tmp, "%s.XXXXXX", path);
+  if (tmp == NULL) {
+    fprintf(stderr, "Failed to generate temporary path\n");
+    exit(10);
+  }
+  fd = mkstemp(tmp);
+  if (fd < 0) {
+    fprintf(stderr, "%s: cannot create `%s`: %s\n", envchain_name, tmp, strerror(errno));
+    rc = 1;
+    goto cleanup;
+  }
+
+  /* the HMAC is filled in once openssl has appended the ciphertext */
+  memset(header, 0, sizeof(header));
+  memcpy(header, ENVCHAIN_ARCHIVE_FILE_MAGIC, ENVCHAIN_ARCHIVE_MAGIC_SIZE);
+  if (envchain_archive_random(header + ENVCHAIN_ARCHIVE_MAGIC_SIZE + ENVCHAIN_HMAC_SIZE,
+                              ENVCHAIN_ARCHIVE_SALT_SIZE) != 0 ||
+      envchain_write_all(fd, (const char*)header, sizeof(header)) < 0) {
+    fprintf(stderr, "%s: cannot write `%s`: %s\n", envchain_name, tmp, strerror(errno));
+    close(fd);
+    unlink(tmp);
+    rc = 1;
+    goto cleanup;
+  }
+
+  if (pipe(data) < 0) {
+    fprintf(stderr, "%s: pipe failed: %s\n", envchain_name, strerror(errno));
+    close(fd);
+    unlink(tmp);
+    rc = 1;
+    goto cleanup;
+  }
+  fcntl(data[1], F_SETFD, FD_CLOEXEC);
+
+  pid = envchain_archive_spawn(0, passphrase, data[0], fd);
+  close(data[0]);
+  if (pid < 0) {
+    fprintf(stderr, "%s: fork failed: %s\n", envchain_name, strerror(errno));
+    close(data[1]);
+    close(fd);
+    unlink(tmp);
+    rc = 1;
+    goto cleanup;
+  }
+
+  /* a failing openssl must surface as an error, not kill us */
+  signal(SIGPIPE, SIG_IGN);
+  context.out = fdopen(data[1], "w");
+  if (context.out == NULL) {
+    fprintf(stderr, "%s: fdopen failed: %s\n", envchain_name, strerror(errno));
+    close(data[1]);
+    rc = 1;
+  }
+  else {
+    fputs(ENVCHAIN_ARCHIVE_MAGIC, context.out);
+    if (envchain_search_all_values(&envchain_backup_item_callback, &context) != 0) rc = 1;
+    if (fclose(context.out) != 0) {
+      fprintf(stderr, "%s: cannot write archive: %s\n", envchain_name, strerror(errno));
+      rc = 1;
+    }
+  }
+  if (envchain_archive_wait(pid) != 0) {
+    fprintf(stderr, "%s: openssl failed\n", envchain_name);
+    rc = 1;
+  }
+  if (rc == 0 && envchain_archive_seal(fd, passphrase) != 0) {
+    fprintf(stderr, "%s: cannot write `%s`: %s\n", envchain_name, tmp, strerror(errno));
+    rc = 1;
+  }
+  if (close(fd) < 0 && rc == 0) {
+    fprintf(stderr, "%s: cannot write `%s`: %s\n", envchain_name, tmp, strerror(errno));
+    rc = 1;
+  }
+
+  if (rc == 0 && rename(tmp, path) < 0) {
+    fprintf(stderr, "%s: cannot rename to `%s`: %s\n", envchain_name, path, strerror(errno));
+    rc = 1;
+  }
+  if (rc != 0) unlink(tmp);
+
+  if (isatty(STDERR_FILENO) && 64 <= context.count) fprintf(stderr, "\n");
+  fprintf(stderr, "%s: backed up %d items to %s (%d skipped)%s\n",
+          envchain_name, context.count, path, context.failures,
+          rc == 0 ? "" : ", archive not written");
+  if (context.failures != 0) rc = 1;
+
+cleanup:
+  memset(passphrase, 0, strlen(passphrase));
+  free(passphrase);
+  if (tmp != NULL) free(tmp);
+  return rc;
+}
+
+/* Splits the decrypted archive into records in place. Returns the number of
+ * records, or -1 when the archive is malformed. */
+static int
+envchain_archive_parse(char *buf, size_t len, envchain_archive_record **out_records)
+{
+  char *p, *end = buf + len, *nl, *tab1, *tab2, *tab3, *numend;
+  unsigned long value_len;
+  long require_passphrase;
+  envchain_archive_record *records = NULL;
+  int count = 0, cap = 0;
+
+  if (len < strlen(ENVCHAIN_ARCHIVE_MAGIC) ||
+      memcmp(buf, ENVCHAIN_ARCHIVE_MAGIC, strlen(ENVCHAIN_ARCHIVE_MAGIC)) != 0)
+    goto malformed;
+
+  for (p = buf + strlen(ENVCHAIN_ARCHIVE_MAGIC); p < end; p = nl + value_len + 2) {
+    nl = memchr(p, '\n', end - p);
+    if (nl == NULL) goto malformed;
+    tab1 = memchr(p, '\t', nl - p);
+    if (tab1 == NULL) goto malformed;
+    tab2 = memchr(tab1 + 1, '\t', nl - (tab1 + 1));
+    if (tab2 == NULL) goto malformed;
+    tab3 = memchr(tab2 + 1, '\t', nl - (tab2 + 1));
+    if (tab3 == NULL) goto malformed;
+
+    errno = 0;
+    require_passphrase = strtol(tab2 + 1, &numend, 10);
+    if (errno != 0 || numend != tab3 || require_passphrase < -1 || 1 < require_passphrase)
+      goto malformed;
+
+    if (tab3[1] < '0' || '9' < tab3[1]) goto malformed;
+    errno = 0;
+    value_len = strtoul(tab3 + 1, &numend, 10);
+    if (errno != 0 || numend != nl) goto malformed;
+    /* value and its trailing newline must fit; checked before any arithmetic */
+    if (value_len >= (size_t)(end - (nl + 1)) || nl[1 + value_len] != '\n') goto malformed;
+
+    if (count == cap) {
+      cap = cap ? cap * 2 : 64;
+      records = realloc(records, sizeof(envchain_archive_record) * cap);
+      if (records == NULL) {
+        fprintf(stderr, "malloc fail (records)\n");
+        exit(10);
+      }
+    }
+
+    *tab1 = '\0';
+    *tab2 = '\0';
+    nl[1 + value_len] = '\0';
+    records[count].name = p;
+    records[count].key = tab1 + 1;
+    records[count].value = nl + 1;
+    records[count].require_passphrase = (int)require_passphrase;
+    count++;
+  }
+
+  *out_records = records;
+  return count;
+
+malformed:
+  free(records);
+  return -1;
+}
+
+int
+envchain_restore(int argc, const char **argv)
+{
+  const char *path;
+  char *passphrase = NULL, *file = NULL, *buf = NULL;
+  unsigned char mac[ENVCHAIN_HMAC_SIZE], diff = 0;
+  size_t file_len = 0, len = 0;
+  int in[2], data[2], fd, rc = 0, count, failures = 0, downgraded = 0;
+  pid_t pid, writer;
+  FILE *fp;
+  envchain_archive_record *records = NULL;
+
+  if (argc != 1) envchain_abort_with_help();
+  path = argv[0];
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0 || (fp = fdopen(fd, "r")) == NULL) {
+    fprintf(stderr, "%s: cannot open `%s`: %s\n", envchain_name, path, strerror(errno));
+    if (0 <= fd) close(fd);
+    return 1;
+  }
+  file = envchain_read_stream(fp, path, &file_len);
+  fclose(fp);
+  if (file == NULL) return 1;
+
+  if (file_len <= ENVCHAIN_ARCHIVE_HEADER_SIZE ||
+      memcmp(file, ENVCHAIN_ARCHIVE_FILE_MAGIC, ENVCHAIN_ARCHIVE_MAGIC_SIZE) != 0) {
+    fprintf(stderr, "%s: `%s` is not an envchain archive\n", envchain_name, path);
+    rc = 1;
+    goto cleanup;
+  }
+
+  passphrase = envchain_ask_archive_passphrase(0);
+  if (passphrase == NULL) {
+    rc = 1;
+    goto cleanup;
+  }
+
+  /* verify before decrypting; the whole comparison runs regardless */
+  envchain_archive_mac(passphrase,
+    (unsigned char*)file + ENVCHAIN_ARCHIVE_MAGIC_SIZE + ENVCHAIN_HMAC_SIZE,
+    file_len - ENVCHAIN_ARCHIVE_MAGIC_SIZE - ENVCHAIN_HMAC_SIZE, mac);
+  for (int i = 0; i < ENVCHAIN_HMAC_SIZE; i++)
+    diff |= mac[i] ^ (unsigned char)file[ENVCHAIN_ARCHIVE_MAGIC_SIZE + i];
+  if (diff != 0) {
+    fprintf(stderr, "%s: cannot verify `%s` (wrong passphrase or modified archive)\n",
+            envchain_name, path);
+    rc = 1;
+    goto cleanup;
+  }
+
+  if (pipe(in) < 0) {
+    fprintf(stderr, "%s: pipe failed: %s\n", envchain_name, strerror(errno));
+    rc = 1;
+    goto cleanup;
+  }
+  if (pipe(data) < 0) {
+    fprintf(stderr, "%s: pipe failed: %s\n", envchain_name, strerror(errno));
+    close(in[0]);
+    close(in[1]);
+    rc = 1;
+    goto cleanup;
+  }
+  fcntl(in[1], F_SETFD, FD_CLOEXEC);
+  fcntl(data[0], F_SETFD, FD_CLOEXEC);
+
+  pid = envchain_archive_spawn(1, passphrase, in[0], data[1]);
+  close(in[0]);
+  close(data[1]);
+  if (pid < 0) {
+    fprintf(stderr, "%s: fork failed: %s\n", envchain_name, strerror(errno));
+    close(in[1]);
+    close(data[0]);
+    rc = 1;
+    goto cleanup;
+  }
+
+  /* feed the verified bytes, not the file again, while we read the output */
+  writer = fork();
+  if (writer == 0) {
+    close(data[0]);
+    _exit(envchain_write_all(in[1], file + ENVCHAIN_ARCHIVE_HEADER_SIZE,
+                             file_len - ENVCHAIN_ARCHIVE_HEADER_SIZE) < 0 ? 1 : 0);
+  }
+  close(in[1]);
+
+  /* decrypt the whole archive before storing anything, so a wrong
+   * passphrase or a truncated file leaves the store untouched */
+  fp = writer < 0 ? NULL : fdopen(data[0], "r");
+  if (fp == NULL) {
+    fprintf(stderr, "%s: cannot read openssl output: %s\n", envchain_name, strerror(errno));
+    close(data[0]);
+  }
+  else {
+    buf = envchain_read_stream(fp, path, &len);
+    fclose(fp);
+  }
+  if (0 < writer) envchain_archive_wait(writer);
+  if (envchain_archive_wait(pid) != 0 || buf == NULL) {
+    fprintf(stderr, "%s: cannot decrypt `%s`\n", envchain_name, path);
+    rc = 1;
+    goto cleanup;
+  }
+
+  count = envchain_archive_parse(buf, len, &records);
+  if (count < 0) {
+    fprintf(stderr, "%s: `%s` is not an envchain archive\n", envchain_name, path);
+    rc = 1;
+    goto cleanup;
+  }
+
+  /* the namespace registry is rebuilt by one scan after the whole archive,
+   * rather than probing each item for existence */
+  envchain_registry_begin();
+  envchain_registry_rescan();
+  for (int i = 0; i < count; i++) {
+    /* an archive from a platform with access policies must still restore */
+    if (records[i].require_passphrase == 1 && !envchain_supports_access_policy()) {
+      records[i].require_passphrase = -1;
+      downgraded++;
+    }
+    if (envchain_save_value(records[i].name, records[i].key, records[i].value,
+                            records[i].require_passphrase) != 0) {
+      fprintf(stderr, "%s: failed to restore `%s.%s`\n",
+              envchain_name, records[i].name, records[i].key);
+      failures++;
+    }
+    if (isatty(STDERR_FILENO) && ((i + 1) % 64 == 0 || i + 1 == count))
+      fprintf(stderr, "\r%s: %d/%d items", envchain_name, i + 1, count);
+  }
+  envchain_registry_commit();
+  if (isatty(STDERR_FILENO) && 0 < count) fprintf(stderr, "\n");
+
+  fprintf(stderr, "%s: restored %d items from %s (%d failed)\n",
+          envchain_name, count - failures, path, failures);
+  if (downgraded != 0) {
+    fprintf(stderr,
+      "%s: warning: %d items required a passphrase, which is unsupported on this platform; restored without it\n",
+      envchain_name, downgraded);
+  }
+  if (failures != 0) rc = 1;
+
+cleanup:
+  if (passphrase != NULL) {
+    memset(passphrase, 0, strlen(passphrase));
+    free(passphrase);
+  }
+  free(file);
+  if (buf != NULL) {
+    memset(buf, 0, len);
+    free(buf);
+  }
+  free(records);
+  return rc;
+}
+
 static char*
 envchain_namespace_from_argv(int argc, const char **argv)
 {
@@ -382,6 +1521,17 @@ envchain_namespace_from_argv(int argc, const char **argv)
   else if (strcmp(cmd, "--unset") == 0) {
     if (1 < argc) ns = argv[1];
   }
+  else if (strcmp(cmd, "--lazy") == 0) {
+    if (1 < argc && strchr(argv[1], ',') == NULL) ns = argv[1];
+  }
+  else if (strcmp(cmd, "--render") == 0) {
+    i = 2;
+    while (i < argc && argv[i][0] == '-') {
+      if (strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "--output") == 0) i++;
+      i++;
+    }
+    if (i < argc && strchr(argv[i], ',') == NULL) ns = argv[i];
+  }
   else if (strcmp(cmd, "--list") == 0 || strcmp(cmd, "-l") == 0) {
     i = 1;
     while (i < argc) {
@@ -482,6 +1632,16 @@ main(int argc, const char **argv)
     }
   }
 
+  /* archives span every namespace; one keychain per namespace cannot be honoured */
+  if (keychain_target == NULL && keychain_dir != NULL && keychain_dir[0] != '\0' && 0 < argc &&
+      (strcmp(argv[0], "--backup") == 0 || strcmp(argv[0], "--restore") == 0)) {
+    fprintf(stderr,
+      "%s: %s does not support --keychain-dir (ENVCHAIN_KEYCHAIN_DIR); use --keychain for each keychain\n",
+      envchain_name, argv[0]);
+    rc = 2;
+    goto cleanup;
+  }
+
   if (envchain_set_keychain(keychain_target) != 0) {
     rc = 1;
     goto cleanup;
@@ -499,6 +1659,12 @@ main(int argc, const char **argv)
     rc = envchain_list(argc, argv);
     goto cleanup;
   }
+  else if (strcmp(argv[0], "--rebuild-registry") == 0) {
+    argv++; argc--;
+    if (0 < argc) envchain_abort_with_help();
+    rc = envchain_registry_rebuild();
+    goto cleanup;
+  }
   else if (strcmp(argv[0], "--unset") == 0) {
     argv++; argc--;
     rc = envchain_unset(argc, argv);
@@ -509,6 +1675,31 @@ main(int argc, const char **argv)
     rc = envchain_set_access(argc, argv);
     goto cleanup;
   }
+  else if (strcmp(argv[0], "--lazy") == 0) {
+    argv++; argc--;
+    rc = envchain_lazy(argc, argv);
+    goto cleanup;
+  }
+  else if (strcmp(argv[0], "--lazy-fetch") == 0) {
+    argv++; argc--;
+    rc = envchain_lazy_fetch(argc, argv);
+    goto cleanup;
+  }
+  else if (strcmp(argv[0], "--render") == 0) {
+    argv++; argc--;
+    rc = envchain_render(argc, argv);
+    goto cleanup;
+  }
+  else if (strcmp(argv[0], "--backup") == 0) {
+    argv++; argc--;
+    rc = envchain_backup(argc, argv);
+    goto cleanup;
+  }
+  else if (strcmp(argv[0], "--restore") == 0) {
+    argv++; argc--;
+    rc = envchain_restore(argc, argv);
+    goto cleanup;
+  }
   else if (argv[0][0] == '-') {
     fprintf(stderr, "Unknown option %s\n", argv[0]);
     rc = 2;
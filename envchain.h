@@ -1,27 +1,96 @@
 #ifndef ENVCHAIN_H
 #define ENVCHAIN_H
 
+#include <stdio.h>
+
+/* value exported by --lazy in place of a secret, followed by its namespace */
+#define ENVCHAIN_LAZY_PLACEHOLDER "envchain-lazy:"
+/* envchain binary the shim runs as `--lazy-fetch NAMESPACE ENV` */
+#define ENVCHAIN_LAZY_HELPER_ENV "ENVCHAIN_LAZY_HELPER"
+/* --lazy-fetch exit status when the item does not exist */
+#define ENVCHAIN_LAZY_NOT_FOUND 3
+
 extern const char *envchain_name;
 
 typedef void (*envchain_search_callback)(const char *key, const char *value,
                                          void *context);
 typedef void (*envchain_namespace_search_callback)(const char *name,
                                                    void *context);
+typedef void (*envchain_namespace_count_callback)(const char *name, int count,
+                                                  void *context);
+typedef void (*envchain_key_search_callback)(const char *key, void *context);
+/* value is NULL when the item could not be read; require_passphrase is 1 or
+ * 0, or -1 when the backend has no per-item access policy */
+typedef void (*envchain_item_search_callback)(const char *name,
+                                              const char *key,
+                                              const char *value,
+                                              int require_passphrase,
+                                              void *context);
 
 typedef struct {
   const char *target;
   int show_value;
 } envchain_list_context;
 
+typedef struct envchain_render_ref {
+  char *name;
+  char *key;
+  char *value;
+  struct envchain_render_ref *next;
+} envchain_render_ref;
+
+typedef struct {
+  const char *name;
+  envchain_render_ref *refs;
+} envchain_render_context;
+
+typedef struct {
+  FILE *out;
+  int count;
+  int failures;
+} envchain_backup_context;
+
 int envchain_search_namespaces(envchain_namespace_search_callback callback,
                                void *data);
 int envchain_search_values(const char *name, envchain_search_callback callback,
                            void *data);
+int envchain_search_selected_values(const char *name, const char **keys,
+                                    int key_count,
+                                    envchain_search_callback callback,
+                                    void *data);
+int envchain_search_keys(const char *name, envchain_key_search_callback callback,
+                         void *data);
+int envchain_search_all_values(envchain_item_search_callback callback,
+                               void *data);
 int envchain_set_keychain(const char *target);
-void envchain_save_value(const char *name, const char *key, char *value,
-                         int require_passphrase);
+int envchain_save_value(const char *name, const char *key, char *value,
+                        int require_passphrase);
 int envchain_update_value_access(const char *name, const char *key,
                                  int require_passphrase);
+/* 1 when save_value can apply require_passphrase, 0 when it must be -1 or 0 */
+int envchain_supports_access_policy(void);
 void envchain_delete_value(const char *name, const char *key);
 
+/* backend storage for the namespace registry (envchain_registry.c) */
+int envchain_scan_namespaces(envchain_namespace_count_callback callback,
+                             void *data);
+/* *text is NULL when there is no registry; returns 1 on error, 2 when the
+ * registry does not cover the current target (a macOS --keychain) */
+int envchain_load_registry(char **text);
+int envchain_store_registry(const char *text);
+
+/* archive MAC (envchain_hmac.c) */
+#define ENVCHAIN_HMAC_SIZE 32
+void envchain_hmac_sha256(const unsigned char *key, size_t key_len,
+                          const void *data, size_t len, unsigned char *out);
+void envchain_pbkdf2_sha256(const char *passphrase, const unsigned char *salt,
+                            size_t salt_len, int iterations, unsigned char *out);
+
+void envchain_registry_begin(void);
+int envchain_registry_commit(void);
+void envchain_registry_rescan(void);
+int envchain_registry_counting(void);
+void envchain_registry_adjust(const char *name, int delta);
+int envchain_registry_rebuild(void);
+
 #endif
@@ -0,0 +1,201 @@
+/* HMAC-SHA256 and PBKDF2 for the --backup archive
+ *
+ * `openssl enc` only offers unauthenticated modes, so the archive carries an
+ * HMAC over the ciphertext. The key is derived from the archive passphrase
+ * with its own salt. Only the MAC is computed here; encryption stays in
+ * openssl(1), so envchain does not link against libcrypto.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "envchain.h"
+
+typedef struct {
+  uint32_t state[8];
+  uint64_t bytes;
+  unsigned char block[64];
+  size_t used;
+} envchain_sha256_ctx;
+
+static const uint32_t envchain_sha256_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ENVCHAIN_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void
+envchain_sha256_compress(envchain_sha256_ctx *ctx, const unsigned char *p)
+{
+  uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+  int i;
+
+  for (i = 0; i < 16; i++) {
+    w[i] = (uint32_t)p[i * 4] << 24 | (uint32_t)p[i * 4 + 1] << 16 |
+           (uint32_t)p[i * 4 + 2] << 8 | (uint32_t)p[i * 4 + 3];
+  }
+  for (i = 16; i < 64; i++) {
+    w[i] = w[i - 16] + w[i - 7] +
+           (ENVCHAIN_ROTR(w[i - 15], 7) ^ ENVCHAIN_ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+           (ENVCHAIN_ROTR(w[i - 2], 17) ^ ENVCHAIN_ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10));
+  }
+
+  a = ctx->state[0]; b = ctx->state[1]; c = ctx->state[2]; d = ctx->state[3];
+  e = ctx->state[4]; f = ctx->state[5]; g = ctx->state[6]; h = ctx->state[7];
+  for (i = 0; i < 64; i++) {
+    t1 = h + (ENVCHAIN_ROTR(e, 6) ^ ENVCHAIN_ROTR(e, 11) ^ ENVCHAIN_ROTR(e, 25)) +
+         ((e & f) ^ (~e & g)) + envchain_sha256_k[i] + w[i];
+    t2 = (ENVCHAIN_ROTR(a, 2) ^ ENVCHAIN_ROTR(a, 13) ^ ENVCHAIN_ROTR(a, 22)) +
+         ((a & b) ^ (a & c) ^ (b & c));
+    h = g; g = f; f = e; e = d + t1;
+    d = c; c = b; b = a; a = t1 + t2;
+  }
+  ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+  ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
+}
+
+static void
+envchain_sha256_init(envchain_sha256_ctx *ctx)
+{
+  static const uint32_t iv[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+  };
+
+  memcpy(ctx->state, iv, sizeof(iv));
+  ctx->bytes = 0;
+  ctx->used = 0;
+}
+
+static void
+envchain_sha256_update(envchain_sha256_ctx *ctx, const void *data, size_t len)
+{
+  const unsigned char *p = data;
+  size_t n;
+
+  ctx->bytes += len;
+  while (0 < len) {
+    n = 64 - ctx->used < len ? 64 - ctx->used : len;
+    memcpy(ctx->block + ctx->used, p, n);
+    ctx->used += n;
+    p += n;
+    len -= n;
+    if (ctx->used == 64) {
+      envchain_sha256_compress(ctx, ctx->block);
+      ctx->used = 0;
+    }
+  }
+}
+
+static void
+envchain_sha256_final(envchain_sha256_ctx *ctx, unsigned char *out)
+{
+  uint64_t bits = ctx->bytes * 8;
+  unsigned char pad[72] = {0x80};
+  size_t padlen = ctx->used < 56 ? 56 - ctx->used : 120 - ctx->used;
+  int i;
+
+  for (i = 0; i < 8; i++) pad[padlen + i] = (unsigned char)(bits >> (56 - i * 8));
+  envchain_sha256_update(ctx, pad, padlen + 8);
+
+  for (i = 0; i < 8; i++) {
+    out[i * 4] = (unsigned char)(ctx->state[i] >> 24);
+    out[i * 4 + 1] = (unsigned char)(ctx->state[i] >> 16);
+    out[i * 4 + 2] = (unsigned char)(ctx->state[i] >> 8);
+    out[i * 4 + 3] = (unsigned char)ctx->state[i];
+  }
+  memset(ctx, 0, sizeof(envchain_sha256_ctx));
+}
+
+/* HMAC with a key of at most 64 bytes; used with 32-byte keys and passphrases */
+typedef struct {
+  envchain_sha256_ctx inner;
+  envchain_sha256_ctx outer;
+} envchain_hmac_ctx;
+
+static void
+envchain_hmac_init(envchain_hmac_ctx *ctx, const void *key, size_t key_len)
+{
+  unsigned char pad[64], hashed[ENVCHAIN_HMAC_SIZE];
+  int i;
+
+  if (64 < key_len) {
+    envchain_sha256_init(&ctx->inner);
+    envchain_sha256_update(&ctx->inner, key, key_len);
+    envchain_sha256_final(&ctx->inner, hashed);
+    key = hashed;
+    key_len = sizeof(hashed);
+  }
+
+  memset(pad, 0, sizeof(pad));
+  memcpy(pad, key, key_len);
+  for (i = 0; i < 64; i++) pad[i] ^= 0x36;
+  envchain_sha256_init(&ctx->inner);
+  envchain_sha256_update(&ctx->inner, pad, sizeof(pad));
+
+  for (i = 0; i < 64; i++) pad[i] ^= 0x36 ^ 0x5c;
+  envchain_sha256_init(&ctx->outer);
+  envchain_sha256_update(&ctx->outer, pad, sizeof(pad));
+
+  memset(pad, 0, sizeof(pad));
+  memset(hashed, 0, sizeof(hashed));
+}
+
+static void
+envchain_hmac_final(envchain_hmac_ctx *ctx, unsigned char *out)
+{
+  unsigned char inner[ENVCHAIN_HMAC_SIZE];
+
+  envchain_sha256_final(&ctx->inner, inner);
+  envchain_sha256_update(&ctx->outer, inner, sizeof(inner));
+  envchain_sha256_final(&ctx->outer, out);
+  memset(inner, 0, sizeof(inner));
+}
+
+void
+envchain_hmac_sha256(const unsigned char *key, size_t key_len,
+                     const void *data, size_t len, unsigned char *out)
+{
+  envchain_hmac_ctx ctx;
+
+  envchain_hmac_init(&ctx, key, key_len);
+  envchain_sha256_update(&ctx.inner, data, len);
+  envchain_hmac_final(&ctx, out);
+}
+
+/* PBKDF2-HMAC-SHA256 with a single output block (32 bytes) */
+void
+envchain_pbkdf2_sha256(const char *passphrase, const unsigned char *salt,
+                       size_t salt_len, int iterations, unsigned char *out)
+{
+  static const unsigned char block_index[4] = {0, 0, 0, 1};
+  envchain_hmac_ctx base, ctx;
+  unsigned char u[ENVCHAIN_HMAC_SIZE];
+  int i, j;
+
+  /* the keyed pads are computed once and copied for each iteration */
+  envchain_hmac_init(&base, passphrase, strlen(passphrase));
+
+  ctx = base;
+  envchain_sha256_update(&ctx.inner, salt, salt_len);
+  envchain_sha256_update(&ctx.inner, block_index, sizeof(block_index));
+  envchain_hmac_final(&ctx, u);
+  memcpy(out, u, sizeof(u));
+
+  for (i = 1; i < iterations; i++) {
+    ctx = base;
+    envchain_sha256_update(&ctx.inner, u, sizeof(u));
+    envchain_hmac_final(&ctx, u);
+    for (j = 0; j < ENVCHAIN_HMAC_SIZE; j++) out[j] ^= u[j];
+  }
+
+  memset(&base, 0, sizeof(base));
+  memset(u, 0, sizeof(u));
+}
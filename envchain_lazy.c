@@ -0,0 +1,232 @@
+/* libenvchain-lazy: LD_PRELOAD shim for `envchain --lazy`
+ *
+ * `envchain --lazy` exports ENVCHAIN_LAZY_PLACEHOLDER + namespace in place of
+ * each secret. getenv(3) and secure_getenv(3) are interposed so the first
+ * lookup of such a variable runs `envchain --lazy-fetch NAMESPACE ENV` and
+ * reads the value from its stdout. The backend never runs inside the host
+ * process, so no secret service connection or its threads survive a fork.
+ * Found values and confirmed misses are cached for the lifetime of the
+ * process; failed lookups are retried on the next call.
+ *
+ * Built with -fvisibility=hidden; only getenv and secure_getenv are exported.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/auxv.h>
+#include <sys/wait.h>
+
+#include "envchain.h"
+
+#define ENVCHAIN_LAZY_EXPORT __attribute__((visibility("default")))
+
+typedef struct envchain_lazy_entry {
+  char *key;
+  char *value; /* NULL when the item does not exist */
+  struct envchain_lazy_entry *next;
+} envchain_lazy_entry;
+
+static envchain_lazy_entry *envchain_lazy_cache = NULL;
+static pthread_mutex_t envchain_lazy_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* keep the cache lock usable in a child forked while another thread held it */
+static void envchain_lazy_prefork(void) { pthread_mutex_lock(&envchain_lazy_lock); }
+static void envchain_lazy_postfork(void) { pthread_mutex_unlock(&envchain_lazy_lock); }
+
+__attribute__((constructor)) static void
+envchain_lazy_init(void)
+{
+  pthread_atfork(envchain_lazy_prefork, envchain_lazy_postfork, envchain_lazy_postfork);
+}
+
+/* walks environ directly; the real getenv is shadowed by ours */
+static char*
+envchain_lazy_raw_getenv(const char *name)
+{
+  size_t len = strlen(name);
+  char **env;
+
+  if (environ == NULL || len == 0 || strchr(name, '=') != NULL) return NULL;
+
+  for (env = environ; *env != NULL; env++) {
+    if (strncmp(*env, name, len) == 0 && (*env)[len] == '=')
+      return *env + len + 1;
+  }
+  return NULL;
+}
+
+static envchain_lazy_entry*
+envchain_lazy_cache_find(const char *key)
+{
+  envchain_lazy_entry *entry;
+
+  for (entry = envchain_lazy_cache; entry != NULL; entry = entry->next) {
+    if (strcmp(entry->key, key) == 0) return entry;
+  }
+  return NULL;
+}
+
+/* environment for the helper: ours without LD_PRELOAD, so it runs unshimmed */
+static char**
+envchain_lazy_helper_env(void)
+{
+  size_t n = 0, i = 0;
+  char **env, **envp;
+
+  for (env = environ; env != NULL && *env != NULL; env++) n++;
+  envp = malloc(sizeof(char*) * (n + 1));
+  if (envp == NULL) return NULL;
+
+  for (env = environ; env != NULL && *env != NULL; env++) {
+    if (strncmp(*env, "LD_PRELOAD=", strlen("LD_PRELOAD=")) == 0) continue;
+    envp[i++] = *env;
+  }
+  envp[i] = NULL;
+  return envp;
+}
+
+/* Returns 0 with *out set when found, 1 when not found, -1 on error. */
+static int
+envchain_lazy_fetch(const char *name, const char *key, char **out)
+{
+  const char *helper = envchain_lazy_raw_getenv(ENVCHAIN_LAZY_HELPER_ENV);
+  char *args[5], **envp, *buf = NULL, *tmp;
+  size_t len = 0, cap = 0;
+  ssize_t n = -1;
+  int fds[2], status, result = -1;
+  pid_t pid;
+
+  *out = NULL;
+  if (helper == NULL || helper[0] == '\0') return -1;
+
+  args[0] = (char*)helper;
+  args[1] = "--lazy-fetch";
+  args[2] = (char*)name;
+  args[3] = (char*)key;
+  args[4] = NULL;
+
+  envp = envchain_lazy_helper_env();
+  if (envp == NULL) return -1;
+  if (pipe2(fds, O_CLOEXEC) < 0) {
+    free(envp);
+    return -1;
+  }
+
+  pid = fork();
+  if (pid < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    free(envp);
+    return -1;
+  }
+  if (pid == 0) {
+    /* only async-signal-safe calls between fork and exec */
+    if (dup2(fds[1], STDOUT_FILENO) < 0) _exit(127);
+    execve(helper, args, envp);
+    _exit(127);
+  }
+  close(fds[1]);
+  free(envp);
+
+  for (;;) {
+    if (len == cap) {
+      cap = cap ? cap * 2 : 256;
+      tmp = realloc(buf, cap + 1);
+      if (tmp == NULL) goto drain;
+      buf = tmp;
+    }
+    n = read(fds[0], buf + len, cap - len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    len += n;
+  }
+
+drain:
+  close(fds[0]);
+  while (waitpid(pid, &status, 0) < 0) {
+    if (errno != EINTR) goto done;
+  }
+  if (!WIFEXITED(status) || buf == NULL) goto done;
+
+  if (WEXITSTATUS(status) == 0 && n == 0) {
+    buf[len] = '\0';
+    *out = buf;
+    buf = NULL;
+    result = 0;
+  }
+  else if (WEXITSTATUS(status) == ENVCHAIN_LAZY_NOT_FOUND) {
+    result = 1;
+  }
+
+done:
+  if (buf != NULL) {
+    memset(buf, 0, len);
+    free(buf);
+  }
+  return result;
+}
+
+static char*
+envchain_lazy_resolve(const char *key, char *raw)
+{
+  const size_t prefix_len = strlen(ENVCHAIN_LAZY_PLACEHOLDER);
+  envchain_lazy_entry *entry;
+  char *value = NULL;
+
+  if (raw == NULL || strncmp(raw, ENVCHAIN_LAZY_PLACEHOLDER, prefix_len) != 0)
+    return raw;
+
+  pthread_mutex_lock(&envchain_lazy_lock);
+  entry = envchain_lazy_cache_find(key);
+  pthread_mutex_unlock(&envchain_lazy_lock);
+  if (entry != NULL) return entry->value;
+
+  /* the lock is not held while the helper runs */
+  if (envchain_lazy_fetch(raw + prefix_len, key, &value) < 0) {
+    /* transient failure: reads as unset now, retried on the next call */
+    return NULL;
+  }
+
+  pthread_mutex_lock(&envchain_lazy_lock);
+  entry = envchain_lazy_cache_find(key);
+  if (entry == NULL) {
+    entry = malloc(sizeof(envchain_lazy_entry));
+    if (entry != NULL) entry->key = strdup(key);
+    if (entry == NULL || entry->key == NULL) {
+      pthread_mutex_unlock(&envchain_lazy_lock);
+      free(entry);
+      return value;
+    }
+    /* a missing value is cached too, and reads as unset */
+    entry->value = value;
+    entry->next = envchain_lazy_cache;
+    envchain_lazy_cache = entry;
+    value = NULL;
+  }
+  pthread_mutex_unlock(&envchain_lazy_lock);
+
+  if (value != NULL) {
+    memset(value, 0, strlen(value));
+    free(value);
+  }
+  return entry->value;
+}
+
+ENVCHAIN_LAZY_EXPORT char*
+getenv(const char *name)
+{
+  return envchain_lazy_resolve(name, envchain_lazy_raw_getenv(name));
+}
+
+ENVCHAIN_LAZY_EXPORT char*
+secure_getenv(const char *name)
+{
+  if (getauxval(AT_SECURE)) return NULL;
+  return envchain_lazy_resolve(name, envchain_lazy_raw_getenv(name));
+}
@@ -1,6 +1,8 @@
 #include "envchain.h"
 #include <libsecret/secret.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 int envchain_set_keychain(const char *target) {
   if (target != NULL && target[0] != '\0') {
@@ -12,6 +14,19 @@ int envchain_set_keychain(const char *target) {
   return 0;
 }
 
+static const SecretSchema *envchain_get_registry_schema(void) {
+  static const SecretSchema the_schema = {
+      .name = "envchain.NamespaceRegistry",
+      .flags = SECRET_SCHEMA_NONE,
+      .attributes =
+          {
+              {.name = "version", .type = SECRET_SCHEMA_ATTRIBUTE_STRING},
+              {NULL, 0},
+          },
+  };
+  return &the_schema;
+}
+
 static const SecretSchema *envchain_get_schema(void) {
   static const SecretSchema the_schema = {
       .name = "envchain.EnvironmentVariable",
@@ -26,7 +41,8 @@ static const SecretSchema *envchain_get_schema(void) {
   return &the_schema;
 }
 
-static GList *search_unlocked_collection(const char *name, GError **error) {
+static GList *search_unlocked_collection(const char *name, const char *key,
+                                         GError **error) {
   SecretService *service =
       secret_service_get_sync(SECRET_SERVICE_LOAD_COLLECTIONS, NULL, error);
   if (*error != NULL) {
@@ -82,6 +98,9 @@ static GList *search_unlocked_collection(const char *name, GError **error) {
   if (name != NULL) {
     g_hash_table_insert(attributes, g_strdup("name"), g_strdup(name));
   }
+  if (key != NULL) {
+    g_hash_table_insert(attributes, g_strdup("key"), g_strdup(key));
+  }
   GList *items =
       secret_collection_search_sync(collection, envchain_get_schema(),
                                     attributes, SECRET_SEARCH_ALL, NULL, error);
@@ -92,11 +111,11 @@ static GList *search_unlocked_collection(const char *name, GError **error) {
   return items;
 }
 
-int envchain_search_namespaces(envchain_namespace_search_callback callback,
-                               void *data) {
+int envchain_scan_namespaces(envchain_namespace_count_callback callback,
+                             void *data) {
   GError *error = NULL;
 
-  GList *items = search_unlocked_collection(NULL, &error);
+  GList *items = search_unlocked_collection(NULL, NULL, &error);
   if (error != NULL) {
     fprintf(stderr, "%s: search_unlocked_collection failed with %d: %s\n",
             envchain_name, error->code, error->message);
@@ -105,18 +124,29 @@ int envchain_search_namespaces(envchain_namespace_search_callback callback,
   }
 
   GList *iter;
+  GList *order = NULL;
   GHashTable *names =
       g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
   for (iter = items; iter != NULL; iter = iter->next) {
     SecretItem *item = iter->data;
     GHashTable *attrs = secret_item_get_attributes(item);
-    char *name = g_strdup(g_hash_table_lookup(attrs, "name"));
-    if (g_hash_table_add(names, name)) {
-      callback(name, data);
+    const char *name = g_hash_table_lookup(attrs, "name");
+    gpointer count = NULL;
+    if (!g_hash_table_lookup_extended(names, name, NULL, &count)) {
+      order = g_list_prepend(order, g_strdup(name));
     }
+    g_hash_table_insert(names, g_strdup(name),
+                        GINT_TO_POINTER(GPOINTER_TO_INT(count) + 1));
     g_hash_table_unref(attrs);
   }
 
+  order = g_list_reverse(order);
+  for (iter = order; iter != NULL; iter = iter->next) {
+    callback(iter->data,
+             GPOINTER_TO_INT(g_hash_table_lookup(names, iter->data)), data);
+  }
+
+  g_list_free_full(order, g_free);
   g_hash_table_unref(names);
   g_list_free(items);
   return 0;
@@ -127,7 +157,7 @@ static gboolean try_search_items(const char *name,
                                  envchain_search_callback callback, void *data,
                                  int *result) {
   GError *error = NULL;
-  GList *items = search_unlocked_collection(name, &error);
+  GList *items = search_unlocked_collection(name, NULL, &error);
   if (error != NULL) {
     fprintf(stderr, "%s: search_unlocked_collection failed with %d: %s\n",
             envchain_name, error->code, error->message);
@@ -184,27 +214,227 @@ int envchain_search_values(const char *name, envchain_search_callback callback,
   return 1;
 }
 
-void envchain_save_value(const char *name, const char *key, char *value,
-                         int require_passphrase) {
+// Returns FALSE if the error is retryable
+static gboolean try_search_selected_items(const char *name, const char **keys,
+                                          int key_count,
+                                          envchain_search_callback callback,
+                                          void *data, int *result) {
+  GError *error = NULL;
+  GList *items = search_unlocked_collection(
+      name, key_count == 1 ? keys[0] : NULL, &error);
+  if (error != NULL) {
+    fprintf(stderr, "%s: search_unlocked_collection failed with %d: %s\n",
+            envchain_name, error->code, error->message);
+    g_error_free(error);
+    *result = 1;
+    return TRUE;
+  }
+
+  GList *iter;
+  GList *selected = NULL;
+  for (iter = items; iter != NULL; iter = iter->next) {
+    SecretItem *item = iter->data;
+    GHashTable *attrs = secret_item_get_attributes(item);
+    const char *key = g_hash_table_lookup(attrs, "key");
+    for (int i = 0; i < key_count; i++) {
+      if (key != NULL && strcmp(key, keys[i]) == 0) {
+        selected = g_list_prepend(selected, item);
+        break;
+      }
+    }
+    g_hash_table_unref(attrs);
+  }
+  g_list_free(items);
+
+  /* Load the selected secrets with a single GetSecrets call */
+  if (selected != NULL &&
+      !secret_item_load_secrets_sync(selected, NULL, &error)) {
+    const int error_code = error->code;
+    g_list_free(selected);
+    if (error_code == SECRET_ERROR_PROTOCOL) {
+      g_error_free(error);
+      return FALSE;
+    }
+    fprintf(stderr, "%s: secret_item_load_secrets_sync failed with %d: %s\n",
+            envchain_name, error->code, error->message);
+    g_error_free(error);
+    *result = 1;
+    return TRUE;
+  }
+
+  for (iter = selected; iter != NULL; iter = iter->next) {
+    SecretItem *item = iter->data;
+    SecretValue *value = secret_item_get_secret(item);
+    if (value == NULL) {
+      continue;
+    }
+    GHashTable *attrs = secret_item_get_attributes(item);
+    const char *text = secret_value_get_text(value);
+    if (text != NULL) {
+      callback(g_hash_table_lookup(attrs, "key"), text, data);
+    }
+    secret_value_unref(value);
+    g_hash_table_unref(attrs);
+  }
+
+  g_list_free(selected);
+  *result = 0;
+  return TRUE;
+}
+
+int envchain_search_selected_values(const char *name, const char **keys,
+                                    int key_count,
+                                    envchain_search_callback callback,
+                                    void *data) {
+  if (key_count == 0) {
+    return 0;
+  }
+  for (int retry_count = 0; retry_count < 3; ++retry_count) {
+    int result = -1;
+    if (try_search_selected_items(name, keys, key_count, callback, data,
+                                  &result)) {
+      return result;
+    }
+    secret_service_disconnect();
+  }
+  fprintf(stderr, "%s: too many secret_item_load_secrets_sync failures\n",
+          envchain_name);
+  return 1;
+}
+
+int envchain_search_keys(const char *name, envchain_key_search_callback callback,
+                         void *data) {
+  GError *error = NULL;
+
+  GList *items = search_unlocked_collection(name, NULL, &error);
+  if (error != NULL) {
+    fprintf(stderr, "%s: search_unlocked_collection failed with %d: %s\n",
+            envchain_name, error->code, error->message);
+    g_error_free(error);
+    return 1;
+  }
+
+  /* attributes only; no secret is loaded */
+  GList *iter;
+  for (iter = items; iter != NULL; iter = iter->next) {
+    SecretItem *item = iter->data;
+    GHashTable *attrs = secret_item_get_attributes(item);
+    callback(g_hash_table_lookup(attrs, "key"), data);
+    g_hash_table_unref(attrs);
+  }
+
+  g_list_free(items);
+  return 0;
+}
+
+// Returns FALSE if the error is retryable
+static gboolean try_search_all_items(envchain_item_search_callback callback,
+                                     void *data, int *result) {
+  GError *error = NULL;
+  GList *items = search_unlocked_collection(NULL, NULL, &error);
+  if (error != NULL) {
+    fprintf(stderr, "%s: search_unlocked_collection failed with %d: %s\n",
+            envchain_name, error->code, error->message);
+    g_error_free(error);
+    *result = 1;
+    return TRUE;
+  }
+
+  /* Load all secrets with a single GetSecrets call */
+  if (items != NULL && !secret_item_load_secrets_sync(items, NULL, &error)) {
+    const int error_code = error->code;
+    g_list_free(items);
+    if (error_code == SECRET_ERROR_PROTOCOL) {
+      g_error_free(error);
+      return FALSE;
+    }
+    fprintf(stderr, "%s: secret_item_load_secrets_sync failed with %d: %s\n",
+            envchain_name, error->code, error->message);
+    g_error_free(error);
+    *result = 1;
+    return TRUE;
+  }
+
+  GList *iter;
+  for (iter = items; iter != NULL; iter = iter->next) {
+    SecretItem *item = iter->data;
+    SecretValue *value = secret_item_get_secret(item);
+    GHashTable *attrs = secret_item_get_attributes(item);
+    /* a missing or non-text secret is reported with a NULL value */
+    callback(g_hash_table_lookup(attrs, "name"),
+             g_hash_table_lookup(attrs, "key"),
+             value != NULL ? secret_value_get_text(value) : NULL, -1, data);
+    if (value != NULL) {
+      secret_value_unref(value);
+    }
+    g_hash_table_unref(attrs);
+  }
+
+  g_list_free(items);
+  *result = 0;
+  return TRUE;
+}
+
+int envchain_search_all_values(envchain_item_search_callback callback,
+                               void *data) {
+  for (int retry_count = 0; retry_count < 3; ++retry_count) {
+    int result = -1;
+    if (try_search_all_items(callback, data, &result)) {
+      return result;
+    }
+    secret_service_disconnect();
+  }
+  fprintf(stderr, "%s: too many secret_item_load_secrets_sync failures\n",
+          envchain_name);
+  return 1;
+}
+
+int envchain_save_value(const char *name, const char *key, char *value,
+                        int require_passphrase) {
   if (require_passphrase == 1) {
     fprintf(
         stderr,
         "%s: Sorry, `--require-passphrase' is unsupported on this platform\n",
         envchain_name);
-    return;
+    return 1;
   }
 
   GError *error = NULL;
+  gboolean is_new = FALSE;
+  envchain_registry_begin();
+  // Probe for the item only when the registry tracks counts; a batch that
+  // rescans at commit (--restore) skips this round trip
+  if (envchain_registry_counting()) {
+    GList *existing = search_unlocked_collection(name, key, &error);
+    if (error != NULL) {
+      fprintf(stderr, "%s: search_unlocked_collection failed with %d: %s\n",
+              envchain_name, error->code, error->message);
+      g_error_free(error);
+      envchain_registry_commit();
+      return 1;
+    }
+    is_new = existing == NULL;
+    g_list_free(existing);
+  }
+
   secret_password_store_sync(envchain_get_schema(), SECRET_COLLECTION_DEFAULT,
                              key, value, NULL, &error, "name", name, "key", key,
                              NULL);
+  if (error == NULL && is_new) {
+    envchain_registry_adjust(name, 1);
+  }
+  envchain_registry_commit();
   if (error != NULL) {
     fprintf(stderr, "%s: secret_password_store_sync failed with %d: %s\n",
             envchain_name, error->code, error->message);
     g_error_free(error);
+    return 1;
   }
+  return 0;
 }
 
+int envchain_supports_access_policy(void) { return 0; }
+
 int envchain_update_value_access(const char *name, const char *key,
                                  int require_passphrase) {
   (void)name;
@@ -218,11 +448,71 @@ int envchain_update_value_access(const char *name, const char *key,
 
 void envchain_delete_value(const char *name, const char *key) {
   GError *error = NULL;
-  secret_password_clear_sync(envchain_get_schema(), NULL, &error,
-                             "name", name, "key", key, NULL);
+  // Nothing to delete: leave the registry alone
+  GList *existing = search_unlocked_collection(name, key, &error);
+  if (error != NULL) {
+    fprintf(stderr, "%s: search_unlocked_collection failed with %d: %s\n",
+            envchain_name, error->code, error->message);
+    g_error_free(error);
+    return;
+  }
+  if (existing == NULL) {
+    return;
+  }
+  g_list_free(existing);
+
+  envchain_registry_begin();
+  const gboolean removed = secret_password_clear_sync(
+      envchain_get_schema(), NULL, &error, "name", name, "key", key, NULL);
+  if (error == NULL && removed) {
+    envchain_registry_adjust(name, -1);
+  }
+  envchain_registry_commit();
   if (error != NULL) {
     fprintf(stderr, "%s: secret_password_clear_sync failed with %d: %s\n",
             envchain_name, error->code, error->message);
     g_error_free(error);
   }
 }
+
+int envchain_load_registry(char **out) {
+  GError *error = NULL;
+  *out = NULL;
+  gchar *text = secret_password_lookup_sync(envchain_get_registry_schema(),
+                                            NULL, &error, "version", "1", NULL);
+  if (error != NULL) {
+    fprintf(stderr, "%s: secret_password_lookup_sync failed with %d: %s\n",
+            envchain_name, error->code, error->message);
+    g_error_free(error);
+    return 1;
+  }
+  if (text == NULL) {
+    return 0;
+  }
+
+  /* envchain_registry.c releases it with free() */
+  const size_t len = strlen(text) + 1;
+  *out = malloc(len);
+  if (*out == NULL) {
+    fprintf(stderr, "malloc fail (registry)\n");
+    exit(10);
+  }
+  memcpy(*out, text, len);
+  secret_password_free(text);
+  return 0;
+}
+
+int envchain_store_registry(const char *text) {
+  GError *error = NULL;
+  secret_password_store_sync(envchain_get_registry_schema(),
+                             SECRET_COLLECTION_DEFAULT,
+                             "envchain namespace registry", text, NULL, &error,
+                             "version", "1", NULL);
+  if (error != NULL) {
+    fprintf(stderr, "%s: secret_password_store_sync failed with %d: %s\n",
+            envchain_name, error->code, error->message);
+    g_error_free(error);
+    return 1;
+  }
+  return 0;
+}
@@ -7,6 +7,10 @@
 
 #define ENVCHAIN_SERVICE_PREFIX "envchain-"
 #define ENVCHAIN_ITEM_DESCRIPTION "envchain"
+/* outside ENVCHAIN_SERVICE_PREFIX and without the item description, so
+ * namespace scans never see it */
+#define ENVCHAIN_REGISTRY_SERVICE "envchain.registry"
+#define ENVCHAIN_REGISTRY_ACCOUNT "envchain"
 
 SecKeychainRef envchain_keychain = NULL;
 
@@ -17,12 +21,17 @@ typedef struct {
 } envchain_search_values_applier_data;
 
 typedef struct {
-  envchain_namespace_search_callback callback;
+  envchain_namespace_count_callback callback;
   int head_index;
   char** names;
   void *data;
 } envchain_search_namespaces_context;
 
+typedef struct {
+  envchain_item_search_callback callback;
+  void *data;
+} envchain_search_all_values_applier_data;
+
 static void envchain_fail_osstatus(OSStatus status);
 
 int
@@ -57,7 +66,7 @@ envchain_sortcmp_str(const void *a, const void *b)
 }
 
 static void
-envchain_fail_osstatus(OSStatus status)
+envchain_print_osstatus(OSStatus status)
 {
   CFStringRef str;
   const char *cstr;
@@ -70,6 +79,12 @@ envchain_fail_osstatus(OSStatus status)
     fprintf(stderr, "Error: %s\n", cstr);
   }
   CFRelease(str);
+}
+
+static void
+envchain_fail_osstatus(OSStatus status)
+{
+  envchain_print_osstatus(status);
   exit(10);
 }
 
@@ -275,7 +290,7 @@ envchain_search_namespaces_uniqufier(const char* name, void *raw_context)
 }
 
 int
-envchain_search_namespaces(envchain_namespace_search_callback callback, void *data)
+envchain_scan_namespaces(envchain_namespace_count_callback callback, void *data)
 {
   OSStatus status;
   int result = 0;
@@ -320,14 +335,15 @@ envchain_search_namespaces(envchain_namespace_search_callback callback, void *da
     &envchain_search_values_applier, &applier_context
   );
 
-  qsort(names, CFArrayGetCount(items), sizeof(char*), envchain_sortcmp_str);
-  char *prev_name = NULL;
-  for(int i = 0; i < CFArrayGetCount(items); i++) {
-    if (!prev_name || strcmp(prev_name, names[i]) != 0)
-      callback(names[i], data);
-    prev_name = names[i];
+  qsort(names, context.head_index, sizeof(char*), envchain_sortcmp_str);
+  int run;
+  for(int i = 0; i < context.head_index; i += run) {
+    for (run = 1; i + run < context.head_index; run++) {
+      if (strcmp(names[i], names[i + run]) != 0) break;
+    }
+    callback(names[i], run, data);
   }
-  for(int i = 0; i < CFArrayGetCount(items); i++) free(names[i]);
+  for(int i = 0; i < context.head_index; i++) free(names[i]);
 
   free(names);
 
@@ -396,6 +412,162 @@ fail:
   return result;
 }
 
+static char*
+envchain_copy_attr_string(SecKeychainAttribute *attr)
+{
+  char *str = malloc(attr->length + 1);
+  if (str == NULL) {
+    fprintf(stderr, "malloc fail (attr)\n");
+    exit(10);
+  }
+  memcpy(str, attr->data, attr->length);
+  str[attr->length] = '\0';
+  return str;
+}
+
+/* Returns 1 or 0, or -1 when the item's access cannot be read. */
+static int
+envchain_item_requires_passphrase(SecKeychainItemRef ref)
+{
+  SecAccessRef access_ref = NULL;
+  CFArrayRef acl_list = NULL;
+  CFArrayRef app_list = NULL;
+  CFStringRef desc = NULL;
+  SecKeychainPromptSelector prompt = 0;
+  int result = -1;
+
+  if (SecKeychainItemCopyAccess(ref, &access_ref) != noErr) return -1;
+
+  acl_list = SecAccessCopyMatchingACLList(
+    access_ref, kSecACLAuthorizationDecrypt
+  );
+  if (acl_list != NULL && 0 < CFArrayGetCount(acl_list)) {
+    SecACLRef acl = (SecACLRef)CFArrayGetValueAtIndex(acl_list, 0);
+    if (SecACLCopyContents(acl, &app_list, &desc, &prompt) == noErr)
+      result = (prompt & kSecKeychainPromptRequirePassphase) ? 1 : 0;
+  }
+
+  if (app_list != NULL) CFRelease(app_list);
+  if (desc != NULL) CFRelease(desc);
+  if (acl_list != NULL) CFRelease(acl_list);
+  CFRelease(access_ref);
+  return result;
+}
+
+static void
+envchain_search_all_values_applier(const void *raw_ref, void *raw_context)
+{
+  OSStatus status;
+  envchain_search_all_values_applier_data *context = (envchain_search_all_values_applier_data*) raw_context;
+  SecKeychainItemRef ref = (SecKeychainItemRef) raw_ref;
+
+  SecKeychainAttribute attrs[] = {
+    {kSecServiceItemAttr, 0, NULL},
+    {kSecAccountItemAttr, 0, NULL},
+  };
+  SecKeychainAttributeList list = {2, attrs};
+  SecKeychainAttributeList *copied = &list;
+  SecItemClass klass;
+  UInt32 len = 0;
+  char *rawvalue = NULL;
+  char *service = NULL, *key = NULL, *value = NULL;
+  const char *name = NULL;
+
+  /* attributes first, so an unreadable value can still be reported by name */
+  status = SecKeychainItemCopyContent(ref, &klass, &list, NULL, NULL);
+  if (status != noErr) {
+    copied = NULL;
+    envchain_print_osstatus(status);
+    goto report;
+  }
+
+  for (UInt32 i = 0; i < list.count; i++) {
+    if (list.attr[i].tag == kSecServiceItemAttr) service = envchain_copy_attr_string(&list.attr[i]);
+    if (list.attr[i].tag == kSecAccountItemAttr) key = envchain_copy_attr_string(&list.attr[i]);
+  }
+  if (service != NULL &&
+      strncmp(service, ENVCHAIN_SERVICE_PREFIX, strlen(ENVCHAIN_SERVICE_PREFIX)) == 0)
+    name = &service[strlen(ENVCHAIN_SERVICE_PREFIX)];
+
+  status = SecKeychainItemCopyContent(ref, NULL, NULL, &len, (void*)&rawvalue);
+  if (status != noErr) {
+    rawvalue = NULL;
+    envchain_print_osstatus(status);
+    goto report;
+  }
+
+  value = malloc(len + 1);
+  if (value == NULL) {
+    fprintf(stderr, "malloc fail (value)\n");
+    goto report;
+  }
+  memcpy(value, rawvalue, len);
+  value[len] = '\0';
+
+report:
+  /* value is NULL when the item could not be read */
+  context->callback(name, key, (name && key) ? value : NULL,
+                    value ? envchain_item_requires_passphrase(ref) : -1,
+                    context->data);
+
+  if (value) {
+    memset(value, 0, len);
+    free(value);
+  }
+  if (service) free(service);
+  if (key) free(key);
+  if (rawvalue) SecKeychainItemFreeContent(NULL, rawvalue);
+  if (copied) SecKeychainItemFreeContent(copied, NULL);
+}
+
+int
+envchain_search_all_values(envchain_item_search_callback callback, void *data)
+{
+  OSStatus status;
+  CFArrayRef items = NULL;
+  CFStringRef description = CFStringCreateWithCString(NULL, ENVCHAIN_ITEM_DESCRIPTION, kCFStringEncodingUTF8);
+  CFArrayRef search_list = NULL;
+  CFMutableDictionaryRef query = NULL;
+
+  query = CFDictionaryCreateMutable(
+      kCFAllocatorDefault, 0,
+      &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+  CFDictionarySetValue(query, kSecClass, kSecClassGenericPassword);
+  CFDictionarySetValue(query, kSecAttrDescription, description);
+  CFDictionarySetValue(query, kSecReturnRef, kCFBooleanTrue);
+  CFDictionarySetValue(query, kSecMatchLimit, kSecMatchLimitAll);
+
+  if (envchain_keychain != NULL) {
+    const void *search_vals[] = {envchain_keychain};
+    search_list = CFArrayCreate(
+      NULL, search_vals, 1, &kCFTypeArrayCallBacks
+    );
+    CFDictionarySetValue(query, kSecMatchSearchList, search_list);
+  }
+
+  /* one search for every envchain item, then each item's data is copied */
+  status = SecItemCopyMatching(query, (CFTypeRef *)&items);
+  if (status != noErr) goto fail;
+
+  envchain_search_all_values_applier_data context = {callback, data};
+  CFArrayApplyFunction(
+    items, CFRangeMake(0, CFArrayGetCount(items)),
+    &envchain_search_all_values_applier, &context
+  );
+
+fail:
+  if (items != NULL) CFRelease(items);
+  if (search_list != NULL) CFRelease(search_list);
+  if (query != NULL) CFRelease(query);
+  if (description != NULL) CFRelease(description);
+  if (status != noErr && status != errSecItemNotFound) {
+    envchain_print_osstatus(status);
+    return 1;
+  }
+
+  return 0;
+}
+
 static int
 envchain_find_value(const char *name, const char *key, SecKeychainItemRef *ref)
 {
@@ -413,13 +585,44 @@ envchain_find_value(const char *name, const char *key, SecKeychainItemRef *ref)
   free(service_name);
 
   if (status != noErr && status != errSecItemNotFound) {
-    if (ref != NULL) CFRelease(ref);
-    envchain_fail_osstatus(status);
+    envchain_print_osstatus(status);
+    return -1;
   }
 
   return status == errSecItemNotFound ? 0 : 1;
 }
 
+int
+envchain_search_selected_values(const char *name, const char **keys, int key_count,
+                                envchain_search_callback callback, void *data)
+{
+  SecKeychainItemRef ref;
+  envchain_search_values_applier_data context = {callback, NULL, data};
+  int found, result = 0;
+
+  /* items are looked up one by one, so unreferenced items are never decrypted */
+  for (int i = 0; i < key_count; i++) {
+    ref = NULL;
+    found = envchain_find_value(name, keys[i], &ref);
+    if (found < 0) result = 1;
+    if (found <= 0) continue;
+
+    envchain_search_values_applier(ref, &context);
+    CFRelease(ref);
+  }
+  return result;
+}
+
+int
+envchain_search_keys(const char *name, envchain_key_search_callback callback, void *data)
+{
+  (void)name;
+  (void)callback;
+  (void)data;
+  fprintf(stderr, "%s: `--lazy' is unsupported on this platform\n", envchain_name);
+  return 1;
+}
+
 static int
 envchain_apply_item_access(SecKeychainItemRef ref, int require_passphrase)
 {
@@ -471,18 +674,29 @@ fail:
   if (desc != NULL) CFRelease(desc);
   if (access_ref != NULL) CFRelease(access_ref);
   if (acl_list != NULL) CFRelease(acl_list);
-  if (status != noErr) envchain_fail_osstatus(status);
+  if (status != noErr) {
+    envchain_print_osstatus(status);
+    return 1;
+  }
   return 0;
 }
 
-void
+int
 envchain_save_value(const char *name, const char *key, char *value, int require_passphrase)
 {
   char *service_name = envchain_generate_service_name(name);
   OSStatus status;
   SecKeychainItemRef ref = NULL;
+  int found = envchain_find_value(name, key, &ref);
+  int is_new = found == 0;
+
+  if (found < 0) {
+    free(service_name);
+    return 1;
+  }
 
-  if (envchain_find_value(name, key, &ref) == 0) {
+  if (is_new) {
+    envchain_registry_begin();
     status = SecKeychainAddGenericPassword(
       envchain_keychain,
       strlen(service_name), service_name,
@@ -515,15 +729,36 @@ envchain_save_value(const char *name, const char *key, char *value, int require_
 
   if (status != noErr) goto fail;
 
-  if (require_passphrase >= 0) {
-    envchain_apply_item_access(ref, require_passphrase);
+  if (is_new) {
+    envchain_registry_adjust(name, 1);
+    envchain_registry_commit();
+    is_new = 0;
+  }
+
+  if (require_passphrase >= 0 && envchain_apply_item_access(ref, require_passphrase) != 0) {
+    CFRelease(ref);
+    return 1;
   }
 
 fail:
+  /* the item may exist even though setting its description failed */
+  if (is_new) {
+    if (ref != NULL) envchain_registry_adjust(name, 1);
+    envchain_registry_commit();
+  }
   if (ref != NULL) { CFRelease(ref); }
-  if (status != noErr) envchain_fail_osstatus(status);
+  if (status != noErr) {
+    envchain_print_osstatus(status);
+    return 1;
+  }
 
-  return;
+  return 0;
+}
+
+int
+envchain_supports_access_policy(void)
+{
+  return 1;
 }
 
 int
@@ -536,23 +771,128 @@ envchain_update_value_access(const char *name, const char *key, int require_pass
     return 1;
   }
 
-  if (envchain_find_value(name, key, &ref) == 0) {
+  int found = envchain_find_value(name, key, &ref);
+  if (found < 0) return 1;
+  if (found == 0) {
     fprintf(stderr, "WARNING: key `%s.%s` not found\n", name, key);
     return 1;
   }
 
-  envchain_apply_item_access(ref, require_passphrase);
+  int result = envchain_apply_item_access(ref, require_passphrase);
 
   if (ref != NULL) {
     CFRelease(ref);
   }
-  return 0;
+  return result;
 }
 
 void
 envchain_delete_value(const char *name, const char *key) {
   SecKeychainItemRef ref = NULL;
-  if (envchain_find_value(name, key, &ref) != 0) {
-    SecKeychainItemDelete(ref);
+  if (envchain_find_value(name, key, &ref) > 0) {
+    envchain_registry_begin();
+    if (SecKeychainItemDelete(ref) == noErr) envchain_registry_adjust(name, -1);
+    envchain_registry_commit();
+    CFRelease(ref);
+  }
+}
+
+/* functions for namespace registry */
+
+/* The registry text is kept in the comment attribute of an item with an empty
+ * password, so reading it never needs the decrypt ACL and cannot prompt.
+ *
+ * It lives in the default keychain only and describes the default search
+ * list, which is what --list scans without --keychain. With --keychain (or a
+ * --keychain-dir mapping) it is not read; changes there only mark it stale,
+ * as the target may be part of the search list. */
+
+static OSStatus
+envchain_find_registry_item(SecKeychainRef keychain, SecKeychainItemRef *ref)
+{
+  return SecKeychainFindGenericPassword(
+    keychain,
+    strlen(ENVCHAIN_REGISTRY_SERVICE), ENVCHAIN_REGISTRY_SERVICE,
+    strlen(ENVCHAIN_REGISTRY_ACCOUNT), ENVCHAIN_REGISTRY_ACCOUNT,
+    NULL, NULL,
+    ref
+  );
+}
+
+int
+envchain_load_registry(char **text)
+{
+  OSStatus status;
+  SecKeychainItemRef ref = NULL;
+  SecKeychainAttribute attr_comment = {kSecCommentItemAttr, 0, NULL};
+  SecKeychainAttributeList list = {1, &attr_comment};
+  SecKeychainRef keychain = NULL;
+
+  *text = NULL;
+  if (envchain_keychain != NULL) return 2;
+
+  status = SecKeychainCopyDefault(&keychain);
+  if (status == noErr) {
+    status = envchain_find_registry_item(keychain, &ref);
+    CFRelease(keychain);
   }
+  if (status == errSecItemNotFound) return 0;
+  if (status != noErr) {
+    envchain_print_osstatus(status);
+    return 1;
+  }
+
+  status = SecKeychainItemCopyContent(ref, NULL, &list, NULL, NULL);
+  CFRelease(ref);
+  if (status != noErr) {
+    envchain_print_osstatus(status);
+    return 1;
+  }
+
+  *text = malloc(attr_comment.length + 1);
+  if (*text == NULL) {
+    fprintf(stderr, "malloc fail (registry)\n");
+    exit(10);
+  }
+  if (attr_comment.data != NULL) memcpy(*text, attr_comment.data, attr_comment.length);
+  (*text)[attr_comment.length] = '\0';
+  SecKeychainItemFreeContent(&list, NULL);
+  return 0;
+}
+
+int
+envchain_store_registry(const char *text)
+{
+  OSStatus status;
+  SecKeychainItemRef ref = NULL;
+  SecKeychainAttribute attr_comment = {kSecCommentItemAttr, strlen(text), (void*)text};
+  SecKeychainAttributeList attrs = {1, &attr_comment};
+  SecKeychainRef keychain = NULL;
+
+  /* find and add in the same keychain, whatever --keychain targets */
+  status = SecKeychainCopyDefault(&keychain);
+  if (status == noErr) status = envchain_find_registry_item(keychain, &ref);
+  if (status == errSecItemNotFound) {
+    status = SecKeychainAddGenericPassword(
+      keychain,
+      strlen(ENVCHAIN_REGISTRY_SERVICE), ENVCHAIN_REGISTRY_SERVICE,
+      strlen(ENVCHAIN_REGISTRY_ACCOUNT), ENVCHAIN_REGISTRY_ACCOUNT,
+      0, "",
+      &ref
+    );
+  }
+
+  /* attributes only; the (empty) password is left as is */
+  if (status == noErr) {
+    status = SecKeychainItemModifyAttributesAndData(ref, &attrs, 0, NULL);
+  }
+
+  if (ref != NULL) CFRelease(ref);
+  if (keychain != NULL) CFRelease(keychain);
+  if (status != noErr) {
+    envchain_print_osstatus(status);
+    return 1;
+  }
+
+  return 0;
 }
@@ -0,0 +1,386 @@
+/* Namespace registry
+ *
+ * A single backend item holding every namespace name with its key count, so
+ * --list reads one item instead of enumerating every envchain item.
+ *
+ * Backends call envchain_registry_begin() before writing an item that may
+ * change the counts, envchain_registry_adjust() once it succeeded, and
+ * envchain_registry_commit() afterwards. From begin to commit a per-user lock
+ * file is held, so concurrent envchain processes cannot interleave their
+ * updates, and the registry holds the STALE marker, so a crash in between
+ * leaves a registry that --list will not trust.
+ *
+ * When the registry is missing or damaged at begin, or the batch asked for it
+ * with envchain_registry_rescan(), no deltas are tracked: commit rebuilds the
+ * counts from one full scan instead. The envchain_search_namespaces() fallback
+ * stores such a scan as well.
+ *
+ * Format: header line, then "NAME\tCOUNT\n" sorted by name.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "envchain.h"
+
+#define ENVCHAIN_REGISTRY_HEADER "envchain-registry 1\n"
+#define ENVCHAIN_REGISTRY_STALE "envchain-registry stale\n"
+
+typedef struct {
+  char *name;
+  int count;
+} envchain_registry_entry;
+
+typedef struct {
+  envchain_registry_entry *entries;
+  int len;
+  int cap;
+  int loaded; /* counts known, from the registry or a scan */
+  int stale;  /* counts can no longer be trusted */
+  int rescan; /* commit stores a fresh scan instead of the counts */
+} envchain_registry;
+
+static envchain_registry envchain_registry_batch;
+static int envchain_registry_batch_depth = 0;
+static int envchain_registry_lock_fd = -1;
+
+static void
+envchain_registry_free(envchain_registry *reg)
+{
+  for (int i = 0; i < reg->len; i++) free(reg->entries[i].name);
+  free(reg->entries);
+  memset(reg, 0, sizeof(envchain_registry));
+}
+
+static envchain_registry_entry*
+envchain_registry_find(envchain_registry *reg, const char *name)
+{
+  for (int i = 0; i < reg->len; i++) {
+    if (strcmp(reg->entries[i].name, name) == 0) return &reg->entries[i];
+  }
+  return NULL;
+}
+
+static void
+envchain_registry_put(envchain_registry *reg, const char *name, int count)
+{
+  if (reg->len == reg->cap) {
+    reg->cap = reg->cap ? reg->cap * 2 : 16;
+    reg->entries = realloc(reg->entries, sizeof(envchain_registry_entry) * reg->cap);
+    if (reg->entries == NULL) {
+      fprintf(stderr, "malloc fail (registry)\n");
+      exit(10);
+    }
+  }
+  reg->entries[reg->len].name = strdup(name);
+  reg->entries[reg->len].count = count;
+  if (reg->entries[reg->len].name == NULL) {
+    fprintf(stderr, "malloc fail (registry)\n");
+    exit(10);
+  }
+  reg->len++;
+}
+
+static int
+envchain_registry_sortcmp(const void *a, const void *b)
+{
+  return strcmp(((const envchain_registry_entry*)a)->name,
+                ((const envchain_registry_entry*)b)->name);
+}
+
+/* Returns 0 when parsed, 1 when missing, -1 when inconsistent, -2 when it
+ * cannot be read, -3 when the registry does not cover the current target. */
+static int
+envchain_registry_load(envchain_registry *reg)
+{
+  char *text = NULL, *p, *nl, *tab, *end;
+  long count;
+  int status;
+
+  memset(reg, 0, sizeof(envchain_registry));
+
+  status = envchain_load_registry(&text);
+  if (status == 2) return -3;
+  if (status != 0) return -2;
+  if (text == NULL) return 1;
+
+  if (strncmp(text, ENVCHAIN_REGISTRY_HEADER, strlen(ENVCHAIN_REGISTRY_HEADER)) != 0)
+    goto invalid;
+
+  for (p = text + strlen(ENVCHAIN_REGISTRY_HEADER); *p != '\0'; p = nl + 1) {
+    nl = strchr(p, '\n');
+    if (nl == NULL) goto invalid;
+    *nl = '\0';
+    tab = strchr(p, '\t');
+    if (tab == NULL || tab == p) goto invalid;
+    *tab = '\0';
+
+    errno = 0;
+    count = strtol(tab + 1, &end, 10);
+    if (errno != 0 || *end != '\0' || count <= 0 || envchain_registry_find(reg, p) != NULL)
+      goto invalid;
+
+    envchain_registry_put(reg, p, (int)count);
+  }
+
+  free(text);
+  reg->loaded = 1;
+  return 0;
+
+invalid:
+  free(text);
+  envchain_registry_free(reg);
+  return -1;
+}
+
+static int
+envchain_registry_store(envchain_registry *reg)
+{
+  char *text, *p;
+  size_t len = strlen(ENVCHAIN_REGISTRY_HEADER) + 1;
+  int result;
+
+  if (reg->stale) return envchain_store_registry(ENVCHAIN_REGISTRY_STALE);
+
+  /* name, tab, up to 10 digits and newline per entry */
+  for (int i = 0; i < reg->len; i++) len += strlen(reg->entries[i].name) + 12;
+  text = malloc(len);
+  if (text == NULL) {
+    fprintf(stderr, "malloc fail (registry)\n");
+    exit(10);
+  }
+
+  qsort(reg->entries, reg->len, sizeof(envchain_registry_entry), envchain_registry_sortcmp);
+  p = text + sprintf(text, "%s", ENVCHAIN_REGISTRY_HEADER);
+  for (int i = 0; i < reg->len; i++) {
+    if (reg->entries[i].count <= 0) continue;
+    p += sprintf(p, "%s\t%d\n", reg->entries[i].name, reg->entries[i].count);
+  }
+
+  result = envchain_store_registry(text);
+  free(text);
+  return result;
+}
+
+static void
+envchain_registry_scan_put(const char *name, int count, void *context)
+{
+  envchain_registry *reg = (envchain_registry*)context;
+
+  /* such a name cannot be stored; keep --list scanning */
+  if (strpbrk(name, "\t\n") != NULL) reg->stale = 1;
+  envchain_registry_put(reg, name, count);
+}
+
+/* Fills reg from a full scan; returns 0 on success. */
+static int
+envchain_registry_scan(envchain_registry *reg)
+{
+  memset(reg, 0, sizeof(envchain_registry));
+  if (envchain_scan_namespaces(&envchain_registry_scan_put, reg) != 0) {
+    envchain_registry_free(reg);
+    return 1;
+  }
+  reg->loaded = 1;
+  return 0;
+}
+
+/* Takes the per-user lock serialising registry updates; returns the lock fd,
+ * or -1 when it cannot be taken. */
+static int
+envchain_registry_lock(void)
+{
+  const char *dir = getenv("XDG_RUNTIME_DIR");
+  char *path = NULL;
+  struct stat st;
+  int fd;
+
+  if (dir == NULL || dir[0] == '\0') dir = getenv("TMPDIR");
+  if (dir == NULL || dir[0] == '\0') dir = "/tmp";
+  asprintf(&path, "%s/envchain-%ld.lock", dir, (long)getuid());
+  if (path == NULL) {
+    fprintf(stderr, "malloc fail (registry)\n");
+    exit(10);
+  }
+
+  /* a shared directory may hold someone else's file or a symlink */
+  fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+  if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_uid != getuid()) {
+    fprintf(stderr, "%s: cannot use lock file `%s`\n", envchain_name, path);
+    if (0 <= fd) close(fd);
+    free(path);
+    return -1;
+  }
+  free(path);
+
+  while (flock(fd, LOCK_EX) < 0) {
+    if (errno != EINTR) {
+      close(fd);
+      return -1;
+    }
+  }
+  return fd;
+}
+
+static void
+envchain_registry_warn(void)
+{
+  fprintf(stderr,
+    "%s: failed to update namespace registry; run `%s --rebuild-registry`\n",
+    envchain_name, envchain_name);
+}
+
+void
+envchain_registry_begin(void)
+{
+  envchain_registry *reg = &envchain_registry_batch;
+  int status, marked;
+
+  if (envchain_registry_batch_depth++ > 0) return;
+
+  envchain_registry_lock_fd = envchain_registry_lock();
+  status = envchain_registry_load(reg);
+
+  /* until commit, a crash must not leave counts that look valid; an
+   * unreadable registry is invalidated too, as it may still exist */
+  marked = envchain_store_registry(ENVCHAIN_REGISTRY_STALE) == 0;
+  if (!marked) envchain_registry_warn();
+
+  if (status == 0 && marked && 0 <= envchain_registry_lock_fd) return;
+
+  envchain_registry_free(reg);
+  /* without the lock a scan could miss another writer's item; leave the
+   * registry stale and let --list rebuild it */
+  if (status != -3 && 0 <= envchain_registry_lock_fd) reg->rescan = 1;
+}
+
+void
+envchain_registry_rescan(void)
+{
+  envchain_registry *reg = &envchain_registry_batch;
+
+  if (envchain_registry_batch_depth == 0 || !reg->loaded) return;
+  envchain_registry_free(reg);
+  reg->rescan = 1;
+}
+
+int
+envchain_registry_counting(void)
+{
+  envchain_registry *reg = &envchain_registry_batch;
+
+  return envchain_registry_batch_depth > 0 && reg->loaded && !reg->stale;
+}
+
+int
+envchain_registry_commit(void)
+{
+  envchain_registry *reg = &envchain_registry_batch;
+  int result = 0;
+
+  if (--envchain_registry_batch_depth > 0) return 0;
+
+  if (reg->rescan) {
+    result = envchain_registry_scan(reg);
+    if (result == 0) result = envchain_registry_store(reg);
+  }
+  else if (reg->loaded) {
+    result = envchain_registry_store(reg);
+  }
+  if (result != 0) envchain_registry_warn();
+
+  envchain_registry_free(reg);
+  if (0 <= envchain_registry_lock_fd) close(envchain_registry_lock_fd);
+  envchain_registry_lock_fd = -1;
+  return result;
+}
+
+void
+envchain_registry_adjust(const char *name, int delta)
+{
+  envchain_registry *reg = &envchain_registry_batch;
+  envchain_registry_entry *entry;
+
+  envchain_registry_begin();
+
+  /* when counts are not tracked, commit rescans or leaves the registry stale */
+  if (reg->loaded && !reg->stale) {
+    entry = envchain_registry_find(reg, name);
+    if (strpbrk(name, "\t\n") != NULL) {
+      reg->stale = 1;
+    }
+    else if (entry != NULL) {
+      entry->count += delta;
+      if (entry->count < 0) reg->stale = 1;
+    }
+    else if (0 < delta) {
+      envchain_registry_put(reg, name, delta);
+    }
+    else {
+      reg->stale = 1;
+    }
+  }
+
+  envchain_registry_commit();
+}
+
+int
+envchain_registry_rebuild(void)
+{
+  envchain_registry reg;
+  int fd, status;
+
+  status = envchain_registry_load(&reg);
+  envchain_registry_free(&reg);
+  if (status == -3) {
+    fprintf(stderr, "%s: the namespace registry is not used with --keychain\n", envchain_name);
+    return 1;
+  }
+
+  fd = envchain_registry_lock();
+  if (envchain_registry_scan(&reg) != 0 || envchain_registry_store(&reg) != 0) {
+    envchain_registry_free(&reg);
+    if (0 <= fd) close(fd);
+    return 1;
+  }
+  if (0 <= fd) close(fd);
+
+  fprintf(stderr, "%s: registered %d namespaces\n", envchain_name, reg.len);
+  envchain_registry_free(&reg);
+  return 0;
+}
+
+int
+envchain_search_namespaces(envchain_namespace_search_callback callback, void *data)
+{
+  envchain_registry reg;
+  int status, fd = -1;
+
+  status = envchain_registry_load(&reg);
+  if (status != 0) {
+    /* scanned under the lock, so a writer's item cannot be missed */
+    if (status != -3) fd = envchain_registry_lock();
+    if (envchain_registry_scan(&reg) != 0) {
+      if (0 <= fd) close(fd);
+      return 1;
+    }
+    /* a registry that is missing or stale is replaced, so the next --list
+     * is cheap again */
+    if (0 <= fd) {
+      envchain_registry_store(&reg);
+      close(fd);
+    }
+  }
+
+  for (int i = 0; i < reg.len; i++) callback(reg.entries[i].name, data);
+  envchain_registry_free(&reg);
+  return 0;
+}